@@ -0,0 +1,191 @@
+﻿/*
+    Copyright (c) 2022 Marcin "Nekiro" Jałocha
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+*/
+
+#include "animationtimelines.h"
+
+namespace nekiro_proto
+{
+
+namespace
+{
+
+// murmur3 finalizer, spreads neighbouring seeds over the whole range
+uint32_t mixSeed(uint32_t seed)
+{
+    seed ^= seed >> 16;
+    seed *= 0x85EBCA6B;
+    seed ^= seed >> 13;
+    seed *= 0xC2B2AE35;
+    seed ^= seed >> 16;
+    return seed;
+}
+
+}
+
+void AnimationTimelines::build(Appearances& appearances)
+{
+    timelines.clear();
+    timelineIndex.clear();
+    stepPhase.clear();
+    stepEndMin.clear();
+    stepEndMax.clear();
+
+    std::vector<uint32_t> order;
+
+    for (int type = OBJECT_TYPE_ITEM; type <= OBJECT_TYPE_MISSILE; type++) {
+        for (const TibiaAppearance& appearance : appearances.getAppearances(static_cast<ObjectType>(type))) {
+            for (int group = 0; group < appearance.frame_group_size(); group++) {
+                const auto& spriteInfo = appearance.frame_group(group).sprite_info();
+                if (!spriteInfo.has_animation() || spriteInfo.animation().sprite_phase_size() < 2) {
+                    continue;
+                }
+
+                const auto& animation = spriteInfo.animation();
+
+                AnimationTimeline timeline;
+                timeline.firstStep = static_cast<uint32_t>(stepPhase.size());
+                timeline.phaseCount = static_cast<uint32_t>(animation.sprite_phase_size());
+                timeline.startPhase = std::min<uint32_t>(animation.default_start_phase(), timeline.phaseCount - 1);
+                timeline.synchronized = animation.synchronized();
+                timeline.randomStartPhase = animation.random_start_phase();
+
+                if (animation.loop_type() == tibia::protobuf::shared::ANIMATION_LOOP_TYPE_COUNTED) {
+                    timeline.loopCount = std::max<uint32_t>(1, animation.loop_count());
+                }
+
+                // pingpong goes forward and back without repeating the end phases
+                order.clear();
+                for (uint32_t phase = 0; phase < timeline.phaseCount; phase++) {
+                    order.push_back(phase);
+                }
+
+                if (animation.loop_type() == tibia::protobuf::shared::ANIMATION_LOOP_TYPE_PINGPONG) {
+                    for (uint32_t phase = timeline.phaseCount - 2; phase > 0; phase--) {
+                        order.push_back(phase);
+                    }
+                }
+
+                uint64_t endMin = 0;
+                uint64_t endMax = 0;
+                for (uint32_t phase : order) {
+                    const auto& spritePhase = animation.sprite_phase(phase);
+                    endMin += spritePhase.duration_min();
+                    endMax += std::max<uint32_t>(spritePhase.duration_min(), spritePhase.duration_max());
+
+                    stepPhase.push_back(phase);
+                    stepEndMin.push_back(endMin);
+                    stepEndMax.push_back(endMax);
+                }
+
+                timeline.stepCount = static_cast<uint32_t>(order.size());
+
+                timelineIndex[makeKey(static_cast<ObjectType>(type), appearance.id(), group)] = static_cast<uint32_t>(timelines.size());
+                timelines.push_back(timeline);
+            }
+        }
+    }
+}
+
+const AnimationTimeline* AnimationTimelines::getTimeline(ObjectType type, uint32_t id, uint32_t frameGroup) const
+{
+    auto it = timelineIndex.find(makeKey(type, id, frameGroup));
+    if (it == timelineIndex.end()) {
+        return nullptr;
+    }
+
+    return &timelines[it->second];
+}
+
+uint32_t AnimationTimelines::phaseAt(ObjectType type, uint32_t id, uint32_t frameGroup, uint64_t elapsedMs, uint32_t seed /* = 0 */) const
+{
+    const AnimationTimeline* timeline = getTimeline(type, id, frameGroup);
+    if (!timeline) {
+        return 0;
+    }
+
+    return phaseAt(*timeline, elapsedMs, seed);
+}
+
+uint32_t AnimationTimelines::phaseAt(const AnimationTimeline& timeline, uint64_t elapsedMs, uint32_t seed /* = 0 */) const
+{
+    if (timeline.synchronized) {
+        seed = 0;
+    }
+
+    // low half picks the duration within [min, max] for every phase, high half the random start phase
+    uint32_t mixed = mixSeed(seed);
+    uint64_t fraction = mixed & 0xFFFF;
+
+    const uint64_t* endMin = &stepEndMin[timeline.firstStep];
+    const uint64_t* endMax = &stepEndMax[timeline.firstStep];
+    auto stepEnd = [=](uint32_t step) {
+        return endMin[step] + (((endMax[step] - endMin[step]) * fraction) >> 16);
+    };
+
+    uint64_t period = stepEnd(timeline.stepCount - 1);
+    if (period == 0) {
+        return timeline.startPhase;
+    }
+
+    uint32_t startPhase = timeline.startPhase;
+    if (timeline.randomStartPhase && !timeline.synchronized) {
+        startPhase = (mixed >> 16) % timeline.phaseCount;
+    }
+
+    // forward steps match phases, so the start phase begins where the previous step ends
+    uint64_t time = elapsedMs + (startPhase > 0 ? stepEnd(startPhase - 1) : 0);
+    if (timeline.loopCount > 0 && time >= period * timeline.loopCount) {
+        return timeline.phaseCount - 1;
+    }
+
+    time %= period;
+
+    // first step ending after time
+    uint32_t low = 0;
+    uint32_t high = timeline.stepCount - 1;
+    while (low < high) {
+        uint32_t mid = (low + high) / 2;
+        if (stepEnd(mid) > time) {
+            high = mid;
+        } else {
+            low = mid + 1;
+        }
+    }
+
+    return stepPhase[timeline.firstStep + low];
+}
+
+void AnimationTimelines::phasesAt(ObjectType type, uint32_t id, uint32_t frameGroup, const std::vector<uint64_t>& elapsedMs, const std::vector<uint32_t>& seeds, std::vector<uint32_t>& phases) const
+{
+    phases.assign(elapsedMs.size(), 0);
+
+    const AnimationTimeline* timeline = getTimeline(type, id, frameGroup);
+    if (!timeline) {
+        return;
+    }
+
+    for (size_t i = 0; i < elapsedMs.size(); i++) {
+        phases[i] = phaseAt(*timeline, elapsedMs[i], i < seeds.size() ? seeds[i] : 0);
+    }
+}
+
+}
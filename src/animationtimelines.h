@@ -0,0 +1,137 @@
+﻿/*
+    Copyright (c) 2022 Marcin "Nekiro" Jałocha
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+*/
+
+#ifndef ANIMATIONTIMELINES_H
+#define ANIMATIONTIMELINES_H
+
+#include "definitions.h"
+#include "appearances.h"
+#include <unordered_map>
+
+namespace nekiro_proto
+{
+
+/**
+ * @struct AnimationTimeline
+ * @brief Precomputed cycle of a single animated frame group.
+ *
+ * A cycle is the sequence of phases shown before the animation repeats, pingpong animations
+ * contain their backward half too. Cumulative durations of the cycle live in AnimationTimelines.
+ */
+struct AnimationTimeline {
+    uint32_t firstStep = 0;    /**< Index of the first step in the shared step tables. */
+    uint32_t stepCount = 0;    /**< Number of steps in one cycle. */
+    uint32_t phaseCount = 0;   /**< Number of distinct phases. */
+    uint32_t startPhase = 0;   /**< Default start phase. */
+    uint32_t loopCount = 0;    /**< Number of cycles for counted animations, 0 for endless ones. */
+    bool synchronized = false; /**< All instances share one clock. */
+    bool randomStartPhase = false; /**< Start phase is picked per instance. */
+};
+
+/**
+ * @class AnimationTimelines
+ * @brief Answers which phase of an animated appearance is shown at a given time.
+ *
+ * Phase durations vary between duration_min and duration_max, a seed picks where in that range
+ * an instance lies, so the same seed always yields the same phase for the same time.
+ */
+class EXPORT AnimationTimelines {
+    public:
+        /**
+         * @brief Default constructor.
+         */
+        AnimationTimelines() = default;
+
+        /**
+         * @brief Constructor that builds timelines from loaded appearances.
+         * @param appearances Loaded appearances.
+         */
+        AnimationTimelines(Appearances& appearances) {
+            build(appearances);
+        }
+
+        /**
+         * @brief Builds timelines for every animated frame group, replacing previous ones.
+         * @param appearances Loaded appearances.
+         * @throws std::exception if appearances are not loaded.
+         */
+        void build(Appearances& appearances);
+
+        /**
+         * @brief Finds the timeline of a frame group.
+         * @param type The type of object.
+         * @param id The appearance ID.
+         * @param frameGroup Index of the frame group in the appearance.
+         * @return const AnimationTimeline* The timeline, nullptr if the frame group isn't animated.
+         */
+        const AnimationTimeline* getTimeline(ObjectType type, uint32_t id, uint32_t frameGroup) const;
+
+        /**
+         * @brief Gets the phase shown at the given time.
+         *
+         * For synchronized animations pass a clock shared by all instances, the seed is ignored.
+         *
+         * @param type The type of object.
+         * @param id The appearance ID.
+         * @param frameGroup Index of the frame group in the appearance.
+         * @param elapsedMs Milliseconds since the animation started.
+         * @param seed Per instance value, eg. a creature or tile id.
+         * @return uint32_t The phase, 0 if the frame group isn't animated.
+         */
+        uint32_t phaseAt(ObjectType type, uint32_t id, uint32_t frameGroup, uint64_t elapsedMs, uint32_t seed = 0) const;
+
+        /**
+         * @brief Gets the phase shown at the given time.
+         * @param timeline Timeline obtained from getTimeline.
+         * @param elapsedMs Milliseconds since the animation started.
+         * @param seed Per instance value, eg. a creature or tile id.
+         * @return uint32_t The phase.
+         */
+        uint32_t phaseAt(const AnimationTimeline& timeline, uint64_t elapsedMs, uint32_t seed = 0) const;
+
+        /**
+         * @brief Gets phases of many instances of the same frame group at once.
+         * @param type The type of object.
+         * @param id The appearance ID.
+         * @param frameGroup Index of the frame group in the appearance.
+         * @param elapsedMs Milliseconds since each instance started.
+         * @param seeds Per instance values, same size as elapsedMs.
+         * @param phases Receives one phase per instance.
+         */
+        void phasesAt(ObjectType type, uint32_t id, uint32_t frameGroup, const std::vector<uint64_t>& elapsedMs, const std::vector<uint32_t>& seeds, std::vector<uint32_t>& phases) const;
+
+    private:
+        static uint64_t makeKey(ObjectType type, uint32_t id, uint32_t frameGroup) {
+            return (static_cast<uint64_t>(type) << 56) | (static_cast<uint64_t>(frameGroup) << 32) | id;
+        }
+
+        std::vector<AnimationTimeline> timelines; /**< All animated frame groups. */
+        std::unordered_map<uint64_t, uint32_t> timelineIndex; /**< Key of a frame group to its timeline. */
+
+        std::vector<uint32_t> stepPhase; /**< Phase shown by each step. */
+        std::vector<uint64_t> stepEndMin; /**< Cycle time at which each step ends, with minimal durations. */
+        std::vector<uint64_t> stepEndMax; /**< Cycle time at which each step ends, with maximal durations. */
+};
+
+}
+
+#endif
@@ -22,11 +22,99 @@
 
 #include "definitions.h"
 #include "appearances.h"
+#include "hashing.h"
+#include <thread>
+#include <atomic>
+#include <unordered_map>
 
 namespace nekiro_proto
 {
 
-void Appearances::parseAppearancesFromFile(const std::string& path)
+namespace
+{
+
+struct AppearanceRecord {
+    ObjectType type;
+    size_t offset;
+    uint32_t size;
+    size_t index;
+};
+
+uint64_t hashAppearance(const TibiaAppearance& appearance, std::string& scratch)
+{
+    scratch.clear();
+    appearance.SerializeToString(&scratch);
+    return fnv1a(scratch);
+}
+
+bool readVarint(const uint8_t* data, size_t length, size_t& pos, uint64_t& value)
+{
+    value = 0;
+    for (int shift = 0; shift < 64 && pos < length; shift += 7) {
+        uint8_t byte = data[pos++];
+        value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+    Walks the top-level fields of Appearances without parsing them.
+    Fields 1-4 are the repeated Appearance messages, anything else is skipped.
+*/
+bool scanAppearanceRecords(const std::string& buffer, std::vector<AppearanceRecord>& records, std::array<size_t, OBJECT_TYPE_MISSILE + 1>& counts)
+{
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(buffer.data());
+    size_t length = buffer.size();
+    size_t pos = 0;
+
+    while (pos < length) {
+        uint64_t tag;
+        if (!readVarint(data, length, pos, tag)) {
+            return false;
+        }
+
+        uint64_t field = tag >> 3;
+        uint64_t value;
+
+        switch (tag & 0x7) {
+            case 0: // varint
+                if (!readVarint(data, length, pos, value)) {
+                    return false;
+                }
+                break;
+            case 1: // fixed64
+                pos += 8;
+                break;
+            case 2: // length delimited
+                if (!readVarint(data, length, pos, value) || value > length - pos) {
+                    return false;
+                }
+
+                if (field >= 1 && field <= 4) {
+                    ObjectType type = static_cast<ObjectType>(field - 1);
+                    records.push_back(AppearanceRecord{ type, pos, static_cast<uint32_t>(value), counts[type]++ });
+                }
+
+                pos += value;
+                break;
+            case 5: // fixed32
+                pos += 4;
+                break;
+            default: // groups are not used by this schema
+                return false;
+        }
+    }
+
+    return pos == length;
+}
+
+}
+
+void Appearances::parseAppearancesFromFile(const std::string& path, bool parallel /* = false */)
 {
     std::ifstream file(path, std::ios::binary);
     if (!file.is_open()) {
@@ -39,11 +127,21 @@ void Appearances::parseAppearancesFromFile(const std::string& path)
     // close file
     file.close();
 
-    parseAppearancesFromMemory(buffer);
+    parseAppearancesFromMemory(buffer, parallel);
 }
 
-void Appearances::parseAppearancesFromMemory(std::stringstream& input)
+void Appearances::parseAppearancesFromMemory(std::stringstream& input, bool parallel /* = false */)
 {
+    if (parallel) {
+        if (!parseAppearancesParallel(input.str())) {
+            throw std::exception("Unable to parse appearances lib.");
+        }
+
+        buildSpriteIndex();
+        isLoaded = true;
+        return;
+    }
+
     TibiaAppearances tibiaAppearances;
     if (!tibiaAppearances.ParseFromIstream(&input)) {
         throw std::exception("Unable to parse appearances lib.");
@@ -64,7 +162,206 @@ void Appearances::parseAppearancesFromMemory(std::stringstream& input)
         appearances[type] = std::vector<TibiaAppearance>(repeatedAppearances->begin(), repeatedAppearances->end());
     }
 
+    hashAppearances();
+    buildSpriteIndex();
+
     isLoaded = true;
 }
 
+bool Appearances::parseAppearancesParallel(const std::string& buffer)
+{
+    std::vector<AppearanceRecord> records;
+    std::array<size_t, OBJECT_TYPE_MISSILE + 1> counts{};
+    if (!scanAppearanceRecords(buffer, records, counts)) {
+        return false;
+    }
+
+    // every record already knows its slot, so workers write to disjoint elements and order is kept
+    std::array<std::vector<TibiaAppearance>, OBJECT_TYPE_MISSILE + 1> parsed;
+    std::array<std::vector<uint64_t>, OBJECT_TYPE_MISSILE + 1> parsedHashes;
+    for (int type = OBJECT_TYPE_ITEM; type <= OBJECT_TYPE_MISSILE; type++) {
+        parsed[type].resize(counts[type]);
+        parsedHashes[type].resize(counts[type]);
+    }
+
+    // chunks of roughly equal byte size, a few per worker so slow chunks even out
+    size_t workers = std::max<unsigned>(1, std::thread::hardware_concurrency());
+    size_t chunkBytes = std::max<size_t>(buffer.size() / (workers * 8), 1);
+
+    std::vector<size_t> chunks{ 0 };
+    size_t bytes = 0;
+    for (size_t i = 0; i < records.size(); i++) {
+        bytes += records[i].size;
+        if (bytes >= chunkBytes) {
+            chunks.push_back(i + 1);
+            bytes = 0;
+        }
+    }
+
+    if (chunks.back() != records.size()) {
+        chunks.push_back(records.size());
+    }
+
+    std::atomic<size_t> nextChunk{ 0 };
+    std::atomic<bool> failed{ false };
+
+    auto work = [&]() {
+        std::string scratch;
+        for (size_t chunk = nextChunk++; chunk + 1 < chunks.size() && !failed; chunk = nextChunk++) {
+            for (size_t i = chunks[chunk]; i < chunks[chunk + 1]; i++) {
+                const AppearanceRecord& record = records[i];
+                TibiaAppearance& appearance = parsed[record.type][record.index];
+                if (!appearance.ParseFromArray(buffer.data() + record.offset, static_cast<int>(record.size))) {
+                    failed = true;
+                    return;
+                }
+
+                parsedHashes[record.type][record.index] = hashAppearance(appearance, scratch);
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    workers = std::min<size_t>(workers, chunks.size() - 1);
+    try {
+        for (size_t worker = 1; worker < workers; worker++) {
+            threads.emplace_back(work);
+        }
+    } catch (...) {
+        // stop the started workers, destroying joinable threads would terminate the process
+        failed = true;
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+        throw;
+    }
+
+    work();
+
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    if (failed) {
+        return false;
+    }
+
+    appearances = std::move(parsed);
+    hashes = std::move(parsedHashes);
+    return true;
+}
+
+void Appearances::hashAppearances()
+{
+    std::string scratch;
+    for (int type = OBJECT_TYPE_ITEM; type <= OBJECT_TYPE_MISSILE; type++) {
+        hashes[type].clear();
+        hashes[type].reserve(appearances[type].size());
+        for (const TibiaAppearance& appearance : appearances[type]) {
+            hashes[type].push_back(hashAppearance(appearance, scratch));
+        }
+    }
+}
+
+void Appearances::buildSpriteIndex()
+{
+    spriteUsages.clear();
+
+    std::vector<uint32_t> groupSprites;
+    for (int type = OBJECT_TYPE_ITEM; type <= OBJECT_TYPE_MISSILE; type++) {
+        for (const TibiaAppearance& appearance : appearances[type]) {
+            for (int group = 0; group < appearance.frame_group_size(); group++) {
+                const auto& spriteIds = appearance.frame_group(group).sprite_info().sprite_id();
+
+                // a sprite can repeat within a frame group, index it once
+                groupSprites.assign(spriteIds.begin(), spriteIds.end());
+                std::sort(groupSprites.begin(), groupSprites.end());
+                groupSprites.erase(std::unique(groupSprites.begin(), groupSprites.end()), groupSprites.end());
+
+                for (uint32_t spriteId : groupSprites) {
+                    spriteUsages.push_back(SpriteUsage{ spriteId, appearance.id(), static_cast<ObjectType>(type), static_cast<uint32_t>(group) });
+                }
+            }
+        }
+    }
+
+    // stable keeps type, appearance and frame group order within a sprite
+    std::stable_sort(spriteUsages.begin(), spriteUsages.end(), [](const SpriteUsage& a, const SpriteUsage& b) {
+        return a.spriteId < b.spriteId;
+    });
+}
+
+std::vector<SpriteUsage> Appearances::getSpriteUsages(uint32_t spriteId) const
+{
+    if (!isLoaded) {
+        throw std::exception("Load appearances first");
+    }
+
+    auto range = std::equal_range(spriteUsages.begin(), spriteUsages.end(), SpriteUsage{ spriteId }, [](const SpriteUsage& a, const SpriteUsage& b) {
+        return a.spriteId < b.spriteId;
+    });
+
+    return std::vector<SpriteUsage>(range.first, range.second);
+}
+
+AppearancesDiff Appearances::diff(const Appearances& from, const Appearances& to)
+{
+    if (!from.isLoaded || !to.isLoaded) {
+        throw std::exception("Load appearances first");
+    }
+
+    AppearancesDiff result;
+
+    auto addSprites = [&result](const TibiaAppearance& appearance) {
+        for (const auto& frameGroup : appearance.frame_group()) {
+            const auto& spriteIds = frameGroup.sprite_info().sprite_id();
+            result.sprites.insert(result.sprites.end(), spriteIds.begin(), spriteIds.end());
+        }
+    };
+
+    std::unordered_map<uint32_t, size_t> fromIndex;
+    for (int type = OBJECT_TYPE_ITEM; type <= OBJECT_TYPE_MISSILE; type++) {
+        const std::vector<TibiaAppearance>& fromAppearances = from.appearances[type];
+        const std::vector<TibiaAppearance>& toAppearances = to.appearances[type];
+
+        fromIndex.clear();
+        fromIndex.reserve(fromAppearances.size());
+        for (size_t i = 0; i < fromAppearances.size(); i++) {
+            fromIndex[fromAppearances[i].id()] = i;
+        }
+
+        for (size_t i = 0; i < toAppearances.size(); i++) {
+            const TibiaAppearance& appearance = toAppearances[i];
+
+            auto it = fromIndex.find(appearance.id());
+            if (it == fromIndex.end()) {
+                result.added[type].push_back(appearance.id());
+                addSprites(appearance);
+                continue;
+            }
+
+            if (from.hashes[type][it->second] != to.hashes[type][i]) {
+                result.changed[type].push_back(appearance.id());
+                addSprites(fromAppearances[it->second]);
+                addSprites(appearance);
+            }
+
+            // whatever is left afterwards was removed
+            fromIndex.erase(it);
+        }
+
+        for (const auto& [id, index] : fromIndex) {
+            result.removed[type].push_back(id);
+            addSprites(fromAppearances[index]);
+        }
+
+        std::sort(result.removed[type].begin(), result.removed[type].end());
+    }
+
+    std::sort(result.sprites.begin(), result.sprites.end());
+    result.sprites.erase(std::unique(result.sprites.begin(), result.sprites.end()), result.sprites.end());
+
+    return result;
+}
+
 }
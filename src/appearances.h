@@ -43,6 +43,28 @@ enum ObjectType {
     OBJECT_TYPE_MISSILE = 3,   /**< Represents a missile object type. */
 };
 
+/**
+ * @struct SpriteUsage
+ * @brief Frame group of an appearance that uses a sprite.
+ */
+struct SpriteUsage {
+    uint32_t spriteId = 0;                  /**< The sprite ID. */
+    uint32_t appearanceId = 0;              /**< The appearance ID. */
+    ObjectType type = OBJECT_TYPE_ITEM;     /**< The type of object. */
+    uint32_t frameGroup = 0;                /**< Index of the frame group in the appearance. */
+};
+
+/**
+ * @struct AppearancesDiff
+ * @brief Differences between two loaded appearances files.
+ */
+struct AppearancesDiff {
+    std::array<std::vector<uint32_t>, OBJECT_TYPE_MISSILE + 1> added;   /**< IDs only present in the newer file, per object type. */
+    std::array<std::vector<uint32_t>, OBJECT_TYPE_MISSILE + 1> removed; /**< IDs only present in the older file, per object type. */
+    std::array<std::vector<uint32_t>, OBJECT_TYPE_MISSILE + 1> changed; /**< IDs present in both with different content, per object type. */
+    std::vector<uint32_t> sprites; /**< Sorted sprite IDs used by any added, removed or changed appearance. */
+};
+
 /**
  * @class Appearances
  * @brief Class for handling appearances in the Tibia game.
@@ -73,14 +95,16 @@ class EXPORT Appearances {
         /**
          * @brief Parses appearances data from a file.
          * @param path Path to the file containing appearances data.
+         * @param parallel If true, appearances are parsed on all available cores.
          */
-        void parseAppearancesFromFile(const std::string& path);
+        void parseAppearancesFromFile(const std::string& path, bool parallel = false);
 
         /**
          * @brief Parses appearances data from memory.
          * @param input Stringstream containing appearances data.
+         * @param parallel If true, appearances are parsed on all available cores.
          */
-        void parseAppearancesFromMemory(std::stringstream& input);
+        void parseAppearancesFromMemory(std::stringstream& input, bool parallel = false);
 
         /**
          * @brief Gets the appearances of a specific object type.
@@ -96,8 +120,47 @@ class EXPORT Appearances {
             return appearances[type];
         }
 
+        /**
+         * @brief Gets every frame group using a sprite.
+         * @param spriteId The sprite ID.
+         * @return A vector of usages ordered by object type, appearance and frame group.
+         * @throws std::exception if appearances are not loaded.
+         */
+        std::vector<SpriteUsage> getSpriteUsages(uint32_t spriteId) const;
+
+        /**
+         * @brief Compares two loaded appearances files using hashes computed while loading.
+         * @param from The older appearances.
+         * @param to The newer appearances.
+         * @return Added, removed and changed IDs and the sprites they use.
+         * @throws std::exception if either appearances are not loaded.
+         */
+        static AppearancesDiff diff(const Appearances& from, const Appearances& to);
+
     private:
+        /**
+         * @brief Hashes serialized bytes of every appearance, used by diff.
+         */
+        void hashAppearances();
+
+        /**
+         * @brief Builds the sprite to frame group index from loaded appearances.
+         */
+        void buildSpriteIndex();
+
+        /**
+         * @brief Splits the top-level message into appearance records and parses them on worker threads.
+         *
+         * Result is identical to a serial parse, records keep their original order.
+         *
+         * @param buffer Serialized appearances message.
+         * @return bool False if the buffer could not be scanned, nothing is stored in that case.
+         */
+        bool parseAppearancesParallel(const std::string& buffer);
+
         std::array<std::vector<TibiaAppearance>, OBJECT_TYPE_MISSILE + 1> appearances; /**< Array of vectors storing appearances for each object type. */
+        std::array<std::vector<uint64_t>, OBJECT_TYPE_MISSILE + 1> hashes; /**< Hash of each appearance, same layout as appearances. */
+        std::vector<SpriteUsage> spriteUsages; /**< Every sprite usage, sorted by sprite ID. */
 
         bool isLoaded = false; /**< Flag indicating whether appearances are loaded. */
 };
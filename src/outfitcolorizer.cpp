@@ -0,0 +1,219 @@
+﻿/*
+    Copyright (c) 2022 Marcin "Nekiro" Jałocha
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+*/
+
+#include "outfitcolorizer.h"
+
+namespace nekiro_proto
+{
+
+namespace
+{
+
+constexpr int HSI_SI_VALUES = 7;
+constexpr int HSI_H_STEPS = 19;
+
+// client palette, 7 saturation/intensity rows of 19 hues where the first hue is gray
+uint32_t computeColor(int color)
+{
+    float hue = 0;
+    float saturation = 0;
+    float intensity = 0;
+
+    if (color % HSI_H_STEPS != 0) {
+        hue = (color % HSI_H_STEPS) / 18.0f;
+
+        switch (color / HSI_H_STEPS) {
+            case 0: saturation = 0.25f; intensity = 1.00f; break;
+            case 1: saturation = 0.25f; intensity = 0.75f; break;
+            case 2: saturation = 0.50f; intensity = 0.75f; break;
+            case 3: saturation = 0.667f; intensity = 0.75f; break;
+            case 4: saturation = 1.00f; intensity = 1.00f; break;
+            case 5: saturation = 1.00f; intensity = 0.75f; break;
+            default: saturation = 1.00f; intensity = 0.50f; break;
+        }
+    } else {
+        intensity = 1 - static_cast<float>(color) / HSI_H_STEPS / static_cast<float>(HSI_SI_VALUES);
+    }
+
+    float red = intensity;
+    float green = intensity;
+    float blue = intensity;
+
+    if (intensity == 0) {
+        red = green = blue = 0;
+    } else if (saturation != 0) {
+        if (hue < 1.0f / 6.0f) {
+            red = intensity;
+            blue = intensity * (1 - saturation);
+            green = blue + (intensity - blue) * 6 * hue;
+        } else if (hue < 2.0f / 6.0f) {
+            green = intensity;
+            blue = intensity * (1 - saturation);
+            red = green - (intensity - blue) * (6 * hue - 1);
+        } else if (hue < 3.0f / 6.0f) {
+            green = intensity;
+            red = intensity * (1 - saturation);
+            blue = red + (intensity - red) * (6 * hue - 2);
+        } else if (hue < 4.0f / 6.0f) {
+            blue = intensity;
+            red = intensity * (1 - saturation);
+            green = blue - (intensity - red) * (6 * hue - 3);
+        } else if (hue < 5.0f / 6.0f) {
+            blue = intensity;
+            green = intensity * (1 - saturation);
+            red = green + (intensity - green) * (6 * hue - 4);
+        } else {
+            red = intensity;
+            green = intensity * (1 - saturation);
+            blue = red - (intensity - green) * (6 * hue - 5);
+        }
+    }
+
+    auto channel = [](float value) {
+        return static_cast<uint32_t>(std::min<float>(std::max<float>(value, 0.0f), 1.0f) * 255);
+    };
+
+    return 0xFF000000 | (channel(red) << 16) | (channel(green) << 8) | channel(blue);
+}
+
+}
+
+OutfitColorizer::OutfitColorizer(Appearances& appearances, SpriteAppearances& sprites, size_t cacheCapacity /* = 4096 */) : sprites(sprites), cacheCapacity(cacheCapacity)
+{
+    for (const TibiaAppearance& outfit : appearances.getAppearances(OBJECT_TYPE_LOOKTYPE)) {
+        outfits[outfit.id()] = &outfit;
+    }
+}
+
+uint32_t OutfitColorizer::getColor(uint8_t color)
+{
+    static const std::array<uint32_t, HSI_H_STEPS * HSI_SI_VALUES> palette = []() {
+        std::array<uint32_t, HSI_H_STEPS * HSI_SI_VALUES> colors{};
+        for (int i = 0; i < HSI_H_STEPS * HSI_SI_VALUES; i++) {
+            colors[i] = computeColor(i);
+        }
+        return colors;
+    }();
+
+    return color < palette.size() ? palette[color] : palette[0];
+}
+
+SpritePtr OutfitColorizer::colorize(uint32_t outfitId, const OutfitFrame& frame, const OutfitColors& colors)
+{
+    auto outfitIt = outfits.find(outfitId);
+    if (outfitIt == outfits.end()) {
+        return nullptr;
+    }
+
+    int baseId = 0;
+    int templateId = -1;
+    if (!resolveSprites(*outfitIt->second, frame, baseId, templateId)) {
+        return nullptr;
+    }
+
+    // keyed by the sprites drawn, so frames sharing sprites share the result, colors only matter with a template
+    CacheKey key;
+    key.frame = (static_cast<uint64_t>(static_cast<uint32_t>(baseId)) << 32) | static_cast<uint32_t>(templateId);
+    key.look = templateId < 0 ? 0 : colors.head | (colors.body << 8) | (colors.legs << 16) | (static_cast<uint64_t>(colors.feet) << 24);
+
+    auto it = cache.find(key);
+    if (it != cache.end()) {
+        lru.splice(lru.begin(), lru, it->second);
+        return it->second->second;
+    }
+
+    SpritePtr sprite = render(baseId, templateId, colors);
+    if (!sprite || cacheCapacity == 0) {
+        return sprite;
+    }
+
+    lru.emplace_front(key, sprite);
+    cache[key] = lru.begin();
+
+    if (lru.size() > cacheCapacity) {
+        cache.erase(lru.back().first);
+        lru.pop_back();
+    }
+
+    return sprite;
+}
+
+bool OutfitColorizer::resolveSprites(const TibiaAppearance& outfit, const OutfitFrame& frame, int& baseId, int& templateId) const
+{
+    if (frame.frameGroup >= static_cast<uint32_t>(outfit.frame_group_size())) {
+        return false;
+    }
+
+    const auto& info = outfit.frame_group(frame.frameGroup).sprite_info();
+
+    uint32_t layers = std::max<uint32_t>(1, info.layers());
+    uint32_t patternWidth = std::max<uint32_t>(1, info.pattern_width());
+    uint32_t patternHeight = std::max<uint32_t>(1, info.pattern_height());
+    uint32_t patternDepth = std::max<uint32_t>(1, info.pattern_depth());
+    uint32_t phases = info.has_animation() ? std::max<int>(1, info.animation().sprite_phase_size()) : 1;
+
+    if (frame.direction >= patternWidth || frame.addon >= patternHeight || frame.mount >= patternDepth) {
+        return false;
+    }
+
+    // sprite ids are ordered by phase, pattern z, y, x and layer
+    uint64_t index = (((static_cast<uint64_t>(frame.phase % phases) * patternDepth + frame.mount) * patternHeight + frame.addon) * patternWidth + frame.direction) * layers;
+    if (index + layers > static_cast<uint64_t>(info.sprite_id_size())) {
+        return false;
+    }
+
+    baseId = static_cast<int>(info.sprite_id(static_cast<int>(index)));
+    templateId = layers < 2 ? -1 : static_cast<int>(info.sprite_id(static_cast<int>(index) + 1));
+    return true;
+}
+
+SpritePtr OutfitColorizer::render(int baseId, int templateId, const OutfitColors& colors)
+{
+    SpriteSheetPtr sheet = sprites.getSheetBySpriteId(baseId);
+    if (!sheet || !sheet->loaded) {
+        return nullptr;
+    }
+
+    SpritePtr sprite = SpritePtr(new Sprite());
+    sprite->size = sheet->getSpriteSize();
+    sprite->pixels.resize(sprite->size.area() * 4);
+    sprites.copySpriteTo(baseId, sprite->pixels.data(), sprite->pixels.size());
+
+    if (templateId < 0) {
+        return sprite;
+    }
+
+    SpriteSheetPtr templateSheet = sprites.getSheetBySpriteId(templateId);
+    if (!templateSheet || !templateSheet->loaded || templateSheet->getSpriteSize().area() != sprite->size.area()) {
+        return sprite;
+    }
+
+    std::vector<uint8_t> mask(sprite->pixels.size());
+    sprites.copySpriteTo(templateId, mask.data(), mask.size());
+
+    const uint32_t tints[4] = { getColor(colors.head), getColor(colors.body), getColor(colors.legs), getColor(colors.feet) };
+    colorizePixels(sprite->pixels.data(), mask.data(), sprite->pixels.data(), sprite->size.area(), tints);
+
+    return sprite;
+}
+
+}
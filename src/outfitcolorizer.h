@@ -0,0 +1,131 @@
+﻿/*
+    Copyright (c) 2022 Marcin "Nekiro" Jałocha
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+*/
+
+#ifndef OUTFITCOLORIZER_H
+#define OUTFITCOLORIZER_H
+
+#include "definitions.h"
+#include "appearances.h"
+#include "spriteappearances.h"
+#include <list>
+#include <unordered_map>
+
+namespace nekiro_proto
+{
+
+/**
+ * @struct OutfitColors
+ * @brief Outfit color indices into the 133 entry outfit palette.
+ */
+struct OutfitColors {
+    uint8_t head = 0;
+    uint8_t body = 0;
+    uint8_t legs = 0;
+    uint8_t feet = 0;
+};
+
+/**
+ * @struct OutfitFrame
+ * @brief Selects one sprite of an outfit appearance.
+ */
+struct OutfitFrame {
+    uint32_t frameGroup = 0; /**< Index of the frame group, idle or moving. */
+    uint32_t phase = 0;      /**< Animation phase. */
+    uint32_t direction = 0;  /**< Looking direction, pattern x. */
+    uint32_t addon = 0;      /**< Addon, pattern y. */
+    uint32_t mount = 0;      /**< Mounted, pattern z. */
+};
+
+/**
+ * @class OutfitColorizer
+ * @brief Tints outfit sprites by their template layer and caches the results.
+ */
+class EXPORT OutfitColorizer {
+    public:
+        /**
+         * @brief Constructor.
+         * @param appearances Loaded appearances, must outlive the colorizer.
+         * @param sprites Sprite appearances used to read sprites, must outlive the colorizer.
+         * @param cacheCapacity Maximum number of colored sprites kept, least recently used are dropped first.
+         * @throws std::exception if appearances are not loaded.
+         */
+        OutfitColorizer(Appearances& appearances, SpriteAppearances& sprites, size_t cacheCapacity = 4096);
+
+        /**
+         * @brief Gets a colored sprite of an outfit.
+         *
+         * Outfits without a template layer are returned as they are.
+         *
+         * @param outfitId The outfit appearance ID.
+         * @param frame The sprite to color.
+         * @param colors Head, body, legs and feet colors.
+         * @return SpritePtr The colored sprite, nullptr if the outfit or frame doesn't exist.
+         */
+        SpritePtr colorize(uint32_t outfitId, const OutfitFrame& frame, const OutfitColors& colors);
+
+        /**
+         * @brief Gets an outfit palette color.
+         * @param color The color index, out of range indices map to 0.
+         * @return uint32_t The color as 0xFFRRGGBB.
+         */
+        static uint32_t getColor(uint8_t color);
+
+        /**
+         * @brief Drops all cached sprites.
+         */
+        void clearCache() {
+            lru.clear();
+            cache.clear();
+        }
+
+    private:
+        struct CacheKey {
+            uint64_t frame;
+            uint64_t look;
+
+            bool operator==(const CacheKey& other) const {
+                return frame == other.frame && look == other.look;
+            }
+        };
+
+        struct CacheKeyHash {
+            size_t operator()(const CacheKey& key) const {
+                return std::hash<uint64_t>()(key.frame * 0x9E3779B97F4A7C15ULL ^ key.look);
+            }
+        };
+
+        using CacheEntry = std::pair<CacheKey, SpritePtr>;
+
+        bool resolveSprites(const TibiaAppearance& outfit, const OutfitFrame& frame, int& baseId, int& templateId) const;
+        SpritePtr render(int baseId, int templateId, const OutfitColors& colors);
+
+        SpriteAppearances& sprites;
+        std::unordered_map<uint32_t, const TibiaAppearance*> outfits;
+
+        size_t cacheCapacity;
+        std::list<CacheEntry> lru; /**< Most recently used first. */
+        std::unordered_map<CacheKey, std::list<CacheEntry>::iterator, CacheKeyHash> cache;
+};
+
+}
+
+#endif
@@ -0,0 +1,343 @@
+﻿/*
+    Copyright (c) 2022 Marcin "Nekiro" Jałocha
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+*/
+
+#include "pixelformat.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define PIXELFORMAT_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TARGET_AVX2
+#else
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+namespace nekiro_proto
+{
+
+namespace
+{
+
+using ConvertFunction = void(*)(const uint8_t* src, uint8_t* dst, size_t count, bool swizzle, bool premultiply);
+
+// exact round(c * a / 255) without a division
+inline uint8_t premultiplyChannel(uint8_t channel, uint8_t alpha)
+{
+    uint32_t t = channel * alpha + 128;
+    return static_cast<uint8_t>((t + (t >> 8)) >> 8);
+}
+
+void convertScalar(const uint8_t* src, uint8_t* dst, size_t count, bool swizzle, bool premultiply)
+{
+    for (size_t i = 0; i < count; ++i, src += 4, dst += 4) {
+        uint8_t b = src[0];
+        uint8_t g = src[1];
+        uint8_t r = src[2];
+        uint8_t a = src[3];
+
+        if (premultiply) {
+            b = premultiplyChannel(b, a);
+            g = premultiplyChannel(g, a);
+            r = premultiplyChannel(r, a);
+        }
+
+        dst[0] = swizzle ? r : b;
+        dst[1] = g;
+        dst[2] = swizzle ? b : r;
+        dst[3] = a;
+    }
+}
+
+#ifdef PIXELFORMAT_X86
+
+/*
+    Premultiply works on 16-bit lanes, two pixels per register half.
+    Alpha is broadcast to every lane of its pixel, the alpha lane itself
+    is multiplied by 255 so it passes through unchanged.
+*/
+
+inline __m128i premultiplyHalfSSE2(__m128i half)
+{
+    const __m128i alphaLane = _mm_set_epi16(0xFF, 0, 0, 0, 0xFF, 0, 0, 0);
+    const __m128i bias = _mm_set1_epi16(128);
+
+    __m128i alpha = _mm_shufflelo_epi16(half, _MM_SHUFFLE(3, 3, 3, 3));
+    alpha = _mm_shufflehi_epi16(alpha, _MM_SHUFFLE(3, 3, 3, 3));
+    alpha = _mm_or_si128(alpha, alphaLane);
+
+    __m128i t = _mm_add_epi16(_mm_mullo_epi16(half, alpha), bias);
+    return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+inline __m128i premultiplySSE2(__m128i pixels)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i low = premultiplyHalfSSE2(_mm_unpacklo_epi8(pixels, zero));
+    __m128i high = premultiplyHalfSSE2(_mm_unpackhi_epi8(pixels, zero));
+    return _mm_packus_epi16(low, high);
+}
+
+// no pshufb in SSE2, swap red and blue with shifts
+inline __m128i swizzleSSE2(__m128i pixels)
+{
+    const __m128i keep = _mm_set1_epi32(static_cast<int>(0xFF00FF00));
+    const __m128i lowByte = _mm_set1_epi32(0x000000FF);
+
+    __m128i result = _mm_and_si128(pixels, keep);
+    result = _mm_or_si128(result, _mm_and_si128(_mm_srli_epi32(pixels, 16), lowByte));
+    result = _mm_or_si128(result, _mm_slli_epi32(_mm_and_si128(pixels, lowByte), 16));
+    return result;
+}
+
+void convertSSE2(const uint8_t* src, uint8_t* dst, size_t count, bool swizzle, bool premultiply)
+{
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 4));
+        if (premultiply) {
+            pixels = premultiplySSE2(pixels);
+        }
+        if (swizzle) {
+            pixels = swizzleSSE2(pixels);
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * 4), pixels);
+    }
+
+    convertScalar(src + i * 4, dst + i * 4, count - i, swizzle, premultiply);
+}
+
+TARGET_AVX2 inline __m256i premultiplyHalfAVX2(__m256i half)
+{
+    const __m256i alphaLane = _mm256_set1_epi64x(0x00FF000000000000LL);
+    const __m256i bias = _mm256_set1_epi16(128);
+
+    __m256i alpha = _mm256_shufflelo_epi16(half, _MM_SHUFFLE(3, 3, 3, 3));
+    alpha = _mm256_shufflehi_epi16(alpha, _MM_SHUFFLE(3, 3, 3, 3));
+    alpha = _mm256_or_si256(alpha, alphaLane);
+
+    __m256i t = _mm256_add_epi16(_mm256_mullo_epi16(half, alpha), bias);
+    return _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+}
+
+TARGET_AVX2 void convertAVX2(const uint8_t* src, uint8_t* dst, size_t count, bool swizzle, bool premultiply)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i swapRedBlue = _mm256_setr_epi8(
+        2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+        2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i pixels = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i * 4));
+        if (premultiply) {
+            // unpack and pack both stay inside 128-bit lanes, so pixel order is preserved
+            __m256i low = premultiplyHalfAVX2(_mm256_unpacklo_epi8(pixels, zero));
+            __m256i high = premultiplyHalfAVX2(_mm256_unpackhi_epi8(pixels, zero));
+            pixels = _mm256_packus_epi16(low, high);
+        }
+        if (swizzle) {
+            pixels = _mm256_shuffle_epi8(pixels, swapRedBlue);
+        }
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i * 4), pixels);
+    }
+
+    convertSSE2(src + i * 4, dst + i * 4, count - i, swizzle, premultiply);
+}
+
+bool cpuSupportsAVX2()
+{
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) {
+        return false;
+    }
+
+    // AVX and OSXSAVE, then make sure the os saves ymm registers
+    __cpuid(info, 1);
+    if ((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0) {
+        return false;
+    }
+
+    if ((_xgetbv(0) & 0x6) != 0x6) {
+        return false;
+    }
+
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif
+
+// lowest and highest set bit of a 4-bit movemask
+const int8_t firstBit[16] = { -1, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0 };
+const int8_t lastBit[16] = { -1, 0, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3 };
+
+// template colors as little-endian BGRA words, alpha masked off
+const uint32_t maskColors[4] = { 0x00FFFF00, 0x00FF0000, 0x0000FF00, 0x000000FF };
+
+void colorizeScalar(const uint8_t* base, const uint8_t* mask, uint8_t* dst, size_t begin, size_t count, const uint32_t colors[4])
+{
+    for (size_t i = begin; i < count; i++) {
+        uint32_t key;
+        std::memcpy(&key, mask + i * 4, 4);
+        key &= 0x00FFFFFF;
+
+        uint32_t color = 0xFFFFFFFF;
+        for (int part = 0; part < 4; part++) {
+            if (key == maskColors[part]) {
+                color = colors[part] | 0xFF000000;
+                break;
+            }
+        }
+
+        for (int channel = 0; channel < 4; channel++) {
+            dst[i * 4 + channel] = premultiplyChannel(base[i * 4 + channel], static_cast<uint8_t>(color >> (channel * 8)));
+        }
+    }
+}
+
+void scanAlphaScalar(const uint8_t* pixels, size_t begin, size_t count, AlphaScan& scan)
+{
+    for (size_t i = begin; i < count; i++) {
+        uint8_t alpha = pixels[i * 4 + 3];
+        if (alpha != 0) {
+            if (scan.first < 0) {
+                scan.first = static_cast<int>(i);
+            }
+            scan.last = static_cast<int>(i);
+        }
+
+        if (alpha != 0xFF) {
+            scan.opaque = false;
+        }
+    }
+}
+
+ConvertFunction selectConvertFunction()
+{
+#ifdef PIXELFORMAT_X86
+    return cpuSupportsAVX2() ? convertAVX2 : convertSSE2;
+#else
+    return convertScalar;
+#endif
+}
+
+}
+
+void convertPixels(const uint8_t* src, uint8_t* dst, size_t count, PixelFormat format)
+{
+    static const ConvertFunction convert = selectConvertFunction();
+
+    bool swizzle = format == PixelFormat::RGBA || format == PixelFormat::RGBA_PREMULTIPLIED;
+    bool premultiply = format == PixelFormat::BGRA_PREMULTIPLIED || format == PixelFormat::RGBA_PREMULTIPLIED;
+
+    if (!swizzle && !premultiply) {
+        if (src != dst) {
+            std::memcpy(dst, src, count * 4);
+        }
+        return;
+    }
+
+    convert(src, dst, count, swizzle, premultiply);
+}
+
+AlphaScan scanAlpha(const uint8_t* pixels, size_t count)
+{
+    AlphaScan scan;
+    size_t i = 0;
+
+#ifdef PIXELFORMAT_X86
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i full = _mm_set1_epi32(0xFF);
+
+    for (; i + 4 <= count; i += 4) {
+        __m128i alpha = _mm_srli_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pixels + i * 4)), 24);
+
+        int visible = ~_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(alpha, zero))) & 0xF;
+        int opaque = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(alpha, full)));
+
+        if (visible != 0) {
+            if (scan.first < 0) {
+                scan.first = static_cast<int>(i) + firstBit[visible];
+            }
+            scan.last = static_cast<int>(i) + lastBit[visible];
+        }
+
+        if (opaque != 0xF) {
+            scan.opaque = false;
+        }
+    }
+#endif
+
+    scanAlphaScalar(pixels, i, count, scan);
+    return scan;
+}
+
+void colorizePixels(const uint8_t* base, const uint8_t* mask, uint8_t* dst, size_t count, const uint32_t colors[4])
+{
+    size_t i = 0;
+
+#ifdef PIXELFORMAT_X86
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i bias = _mm_set1_epi16(128);
+    const __m128i rgbMask = _mm_set1_epi32(0x00FFFFFF);
+    const __m128i white = _mm_set1_epi32(-1);
+
+    __m128i keys[4];
+    __m128i tints[4];
+    for (int part = 0; part < 4; part++) {
+        keys[part] = _mm_set1_epi32(static_cast<int>(maskColors[part]));
+        tints[part] = _mm_set1_epi32(static_cast<int>(colors[part] | 0xFF000000));
+    }
+
+    auto multiply = [&](__m128i pixels, __m128i factors) {
+        __m128i t = _mm_add_epi16(_mm_mullo_epi16(pixels, factors), bias);
+        return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+    };
+
+    for (; i + 4 <= count; i += 4) {
+        __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(base + i * 4));
+        __m128i key = _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(mask + i * 4)), rgbMask);
+
+        // pixels matching no template color are multiplied by white, which keeps them as they are
+        __m128i factor = white;
+        for (int part = 0; part < 4; part++) {
+            __m128i match = _mm_cmpeq_epi32(key, keys[part]);
+            factor = _mm_or_si128(_mm_and_si128(match, tints[part]), _mm_andnot_si128(match, factor));
+        }
+
+        __m128i low = multiply(_mm_unpacklo_epi8(pixels, zero), _mm_unpacklo_epi8(factor, zero));
+        __m128i high = multiply(_mm_unpackhi_epi8(pixels, zero), _mm_unpackhi_epi8(factor, zero));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * 4), _mm_packus_epi16(low, high));
+    }
+#endif
+
+    colorizeScalar(base, mask, dst, i, count, colors);
+}
+
+}
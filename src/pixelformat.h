@@ -0,0 +1,93 @@
+﻿/*
+    Copyright (c) 2022 Marcin "Nekiro" Jałocha
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+*/
+
+#ifndef PIXELFORMAT_H
+#define PIXELFORMAT_H
+
+#include "definitions.h"
+
+namespace nekiro_proto
+{
+
+/**
+ * @enum PixelFormat
+ * @brief Byte order of 32-bit pixels written to caller memory.
+ *
+ * Sprite sheets are stored as BGRA, so BGRA output is a plain copy.
+ */
+enum class PixelFormat
+{
+    BGRA = 0,                /**< Native sheet order. */
+    RGBA = 1,                /**< Red and blue channels swapped. */
+    BGRA_PREMULTIPLIED = 2,  /**< Native order, color channels multiplied by alpha. */
+    RGBA_PREMULTIPLIED = 3,  /**< Swapped order, color channels multiplied by alpha. */
+};
+
+/**
+ * @brief Converts BGRA pixels to the requested format.
+ *
+ * Uses AVX2 or SSE2 kernels when the cpu supports them and a scalar loop otherwise.
+ * Source and destination may be the same buffer, but must not partially overlap.
+ *
+ * @param src Source pixels in BGRA order.
+ * @param dst Destination pixels, at least count * 4 bytes.
+ * @param count Number of pixels to convert.
+ * @param format Format of the destination pixels.
+ */
+EXPORT void convertPixels(const uint8_t* src, uint8_t* dst, size_t count, PixelFormat format);
+
+/**
+ * @struct AlphaScan
+ * @brief Result of scanning the alpha channel of a pixel row.
+ */
+struct AlphaScan {
+    int first = -1;      /**< Index of the first non-transparent pixel, -1 if none. */
+    int last = -1;       /**< Index of the last non-transparent pixel, -1 if none. */
+    bool opaque = true;  /**< True if every pixel has full alpha. */
+};
+
+/**
+ * @brief Scans the alpha channel of 32-bit pixels, four at a time with SSE2.
+ *
+ * @param pixels Pixels with alpha in the fourth byte.
+ * @param count Number of pixels to scan.
+ * @return AlphaScan Visible span and opacity of the pixels.
+ */
+EXPORT AlphaScan scanAlpha(const uint8_t* pixels, size_t count);
+
+/**
+ * @brief Tints BGRA pixels by the colors selected in a template mask.
+ *
+ * Template pixels that are exactly yellow, red, green or blue select colors[0] to colors[3],
+ * the matching base pixel is multiplied by that color per channel, other pixels are copied.
+ *
+ * @param base Base pixels in BGRA order.
+ * @param mask Template pixels in BGRA order.
+ * @param dst Destination pixels, may be the same buffer as base.
+ * @param count Number of pixels.
+ * @param colors Head, body, legs and feet colors as 0xAARRGGBB, alpha is ignored.
+ */
+EXPORT void colorizePixels(const uint8_t* base, const uint8_t* mask, uint8_t* dst, size_t count, const uint32_t colors[4]);
+
+}
+
+#endif
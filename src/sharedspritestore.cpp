@@ -0,0 +1,382 @@
+﻿/*
+    Copyright (c) 2022 Marcin "Nekiro" Jałocha
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+*/
+
+#include "sharedspritestore.h"
+#include "hashing.h"
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <cerrno>
+#endif
+
+namespace nekiro_proto
+{
+
+namespace
+{
+
+constexpr uint32_t SHARED_STORE_MAGIC = 0x53505354; // "SPST"
+constexpr uint32_t SHARED_STORE_VERSION = 2;
+
+// views must start on the allocation granularity, 64 KiB on Windows
+constexpr uint64_t SHARED_STORE_ALIGNMENT = 65536;
+static_assert((BYTES_IN_SPRITE_SHEET) % SHARED_STORE_ALIGNMENT == 0, "sheet slots must stay aligned");
+
+// how long to wait for a live process before falling back to a private copy
+constexpr auto SHARED_STORE_TIMEOUT = std::chrono::seconds(10);
+
+/*
+    The header and every slot are guarded by a 64-bit word, the low half holds the state
+    and the high half the ID of the process that set it to loading. Waiters take over
+    a loading word whose process has exited.
+*/
+
+enum SlotState : uint32_t {
+    SLOT_EMPTY = 0,
+    SLOT_LOADING = 1,
+    SLOT_READY = 2,
+};
+
+enum ClaimResult {
+    CLAIM_READY,
+    CLAIM_OWNED,
+    CLAIM_BUSY,
+};
+
+uint32_t currentProcessId()
+{
+#ifdef _WIN32
+    return static_cast<uint32_t>(GetCurrentProcessId());
+#else
+    return static_cast<uint32_t>(getpid());
+#endif
+}
+
+bool isProcessAlive(uint32_t pid)
+{
+#ifdef _WIN32
+    HANDLE process = OpenProcess(SYNCHRONIZE, FALSE, static_cast<DWORD>(pid));
+    if (!process) {
+        // no such process, anything else means it exists but we may not touch it
+        return GetLastError() != ERROR_INVALID_PARAMETER;
+    }
+
+    bool alive = WaitForSingleObject(process, 0) == WAIT_TIMEOUT;
+    CloseHandle(process);
+    return alive;
+#else
+    return kill(static_cast<pid_t>(pid), 0) == 0 || errno != ESRCH;
+#endif
+}
+
+ClaimResult tryClaim(std::atomic<uint64_t>& word)
+{
+    uint64_t value = word.load(std::memory_order_acquire);
+    uint32_t state = static_cast<uint32_t>(value);
+
+    if (state == SLOT_READY) {
+        return CLAIM_READY;
+    }
+
+    if (state == SLOT_LOADING && isProcessAlive(static_cast<uint32_t>(value >> 32))) {
+        return CLAIM_BUSY;
+    }
+
+    // empty, or the process loading it has exited
+    uint64_t claimed = (static_cast<uint64_t>(currentProcessId()) << 32) | SLOT_LOADING;
+    return word.compare_exchange_strong(value, claimed, std::memory_order_acquire) ? CLAIM_OWNED : CLAIM_BUSY;
+}
+
+}
+
+/*
+    Segment layout:
+    [0x00, sizeof(Header)):     Header, initialized by whichever process claims it first.
+    [.., slotCount slots):      Index ordered by first sprite ID.
+    [aligned, size):            Pixels, BYTES_IN_SPRITE_SHEET per slot.
+
+    Every process maps the index, sheet slots are mapped on first use so only sheets
+    actually touched take address space and memory.
+*/
+
+struct SharedSpriteStore::Header {
+    std::atomic<uint64_t> state;
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slotCount;
+    uint32_t reserved;
+    uint64_t size;
+};
+
+struct SharedSpriteStore::Slot {
+    std::atomic<uint64_t> state;
+    int32_t firstId;
+    uint32_t reserved;
+    uint64_t fileHash;
+    uint64_t offset;
+};
+
+SharedSpriteStore::SharedSpriteStore(const std::string& name, const std::vector<SharedSheetKey>& keys)
+{
+    static_assert(std::atomic<uint64_t>::is_always_lock_free, "shared memory needs lock-free atomics");
+
+    uint64_t indexSize = sizeof(Header) + keys.size() * sizeof(Slot);
+    uint64_t dataOffset = (indexSize + SHARED_STORE_ALIGNMENT - 1) / SHARED_STORE_ALIGNMENT * SHARED_STORE_ALIGNMENT;
+    uint64_t requestedSize = dataOffset + keys.size() * static_cast<uint64_t>(BYTES_IN_SPRITE_SHEET);
+
+    size = static_cast<size_t>(dataOffset);
+    views.resize(keys.size(), nullptr);
+
+#ifdef _WIN32
+    // reserved only, pages are committed as slots get mapped
+    mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE | SEC_RESERVE, static_cast<DWORD>(requestedSize >> 32), static_cast<DWORD>(requestedSize & 0xFFFFFFFF), name.c_str());
+    if (!mapping) {
+        std::stringstream ss;
+        ss << "Unable to create shared memory. (" << name << ", error " << GetLastError() << ")";
+        throw std::exception(ss.str().c_str());
+    }
+
+    base = static_cast<uint8_t*>(MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size));
+    if (!base || !VirtualAlloc(base, size, MEM_COMMIT, PAGE_READWRITE)) {
+        release();
+        throw std::exception("Unable to map shared memory.");
+    }
+#else
+    fd = shm_open(name.c_str(), O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        std::stringstream ss;
+        ss << "Unable to open shared memory. (" << name << ", errno " << errno << ")";
+        throw std::exception(ss.str().c_str());
+    }
+
+    // a fresh segment is empty, including one whose creator died before sizing it
+    struct stat st {};
+    if (fstat(fd, &st) == 0 && st.st_size == 0 && ftruncate(fd, static_cast<off_t>(requestedSize)) != 0) {
+        release();
+        throw std::exception("Unable to resize shared memory.");
+    }
+
+    if (fstat(fd, &st) != 0 || static_cast<uint64_t>(st.st_size) != requestedSize) {
+        release();
+        throw std::exception("Shared memory belongs to a different catalog.");
+    }
+
+    void* view = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (view == MAP_FAILED) {
+        release();
+        throw std::exception("Unable to map shared memory.");
+    }
+
+    base = static_cast<uint8_t*>(view);
+#endif
+
+    Header* header = reinterpret_cast<Header*>(base);
+    Slot* slots = reinterpret_cast<Slot*>(base + sizeof(Header));
+
+    auto deadline = std::chrono::steady_clock::now() + SHARED_STORE_TIMEOUT;
+    while (true) {
+        ClaimResult result = tryClaim(header->state);
+        if (result == CLAIM_READY) {
+            break;
+        }
+
+        if (result == CLAIM_OWNED) {
+            header->magic = SHARED_STORE_MAGIC;
+            header->version = SHARED_STORE_VERSION;
+            header->slotCount = static_cast<uint32_t>(keys.size());
+            header->size = requestedSize;
+
+            for (size_t i = 0; i < keys.size(); i++) {
+                Slot* slot = new (&slots[i]) Slot();
+                slot->state.store(SLOT_EMPTY, std::memory_order_relaxed);
+                slot->firstId = keys[i].firstId;
+                slot->fileHash = fnv1a(keys[i].file);
+                slot->offset = dataOffset + i * static_cast<uint64_t>(BYTES_IN_SPRITE_SHEET);
+            }
+
+            header->state.store(SLOT_READY, std::memory_order_release);
+            break;
+        }
+
+        if (std::chrono::steady_clock::now() >= deadline) {
+            release();
+            throw std::exception("Shared memory was never initialized.");
+        }
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    if (header->magic != SHARED_STORE_MAGIC || header->version != SHARED_STORE_VERSION || header->size != requestedSize || header->slotCount != keys.size()) {
+        release();
+        throw std::exception("Shared memory belongs to a different catalog.");
+    }
+}
+
+SharedSpriteStore::~SharedSpriteStore()
+{
+    release();
+}
+
+void SharedSpriteStore::release()
+{
+    for (uint8_t*& view : views) {
+        if (!view) {
+            continue;
+        }
+
+#ifdef _WIN32
+        UnmapViewOfFile(view);
+#else
+        munmap(view, BYTES_IN_SPRITE_SHEET);
+#endif
+        view = nullptr;
+    }
+
+#ifdef _WIN32
+    if (base) {
+        UnmapViewOfFile(base);
+    }
+
+    if (mapping) {
+        CloseHandle(mapping);
+    }
+
+    mapping = nullptr;
+#else
+    if (base) {
+        munmap(base, size);
+    }
+
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    fd = -1;
+#endif
+
+    base = nullptr;
+}
+
+void SharedSpriteStore::remove(const std::string& name)
+{
+#ifndef _WIN32
+    shm_unlink(name.c_str());
+#endif
+}
+
+SharedSpriteStore::Slot* SharedSpriteStore::findSlot(const SharedSheetKey& key) const
+{
+    const Header* header = reinterpret_cast<const Header*>(base);
+    Slot* begin = reinterpret_cast<Slot*>(base + sizeof(Header));
+    Slot* end = begin + header->slotCount;
+
+    Slot* slot = std::lower_bound(begin, end, key.firstId, [](const Slot& slot, int firstId) {
+        return slot.firstId < firstId;
+    });
+
+    if (slot == end || slot->firstId != key.firstId || slot->fileHash != fnv1a(key.file)) {
+        return nullptr;
+    }
+
+    return slot;
+}
+
+uint8_t* SharedSpriteStore::mapSlot(const Slot& slot)
+{
+    size_t index = &slot - reinterpret_cast<const Slot*>(base + sizeof(Header));
+
+    std::lock_guard<std::mutex> lock(viewsLock);
+    if (views[index]) {
+        return views[index];
+    }
+
+#ifdef _WIN32
+    void* view = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, static_cast<DWORD>(slot.offset >> 32), static_cast<DWORD>(slot.offset & 0xFFFFFFFF), BYTES_IN_SPRITE_SHEET);
+    if (!view) {
+        return nullptr;
+    }
+
+    // committing pages another process already committed is a no-op
+    if (!VirtualAlloc(view, BYTES_IN_SPRITE_SHEET, MEM_COMMIT, PAGE_READWRITE)) {
+        UnmapViewOfFile(view);
+        return nullptr;
+    }
+#else
+    void* view = mmap(nullptr, BYTES_IN_SPRITE_SHEET, PROT_READ | PROT_WRITE, MAP_SHARED, fd, static_cast<off_t>(slot.offset));
+    if (view == MAP_FAILED) {
+        return nullptr;
+    }
+#endif
+
+    views[index] = static_cast<uint8_t*>(view);
+    return views[index];
+}
+
+const uint8_t* SharedSpriteStore::acquire(const SharedSheetKey& key, const std::function<void(uint8_t*)>& decode)
+{
+    Slot* slot = findSlot(key);
+    if (!slot) {
+        return nullptr;
+    }
+
+    uint8_t* pixels = mapSlot(*slot);
+    if (!pixels) {
+        return nullptr;
+    }
+
+    auto deadline = std::chrono::steady_clock::now() + SHARED_STORE_TIMEOUT;
+
+    while (true) {
+        ClaimResult result = tryClaim(slot->state);
+        if (result == CLAIM_READY) {
+            return pixels;
+        }
+
+        if (result == CLAIM_OWNED) {
+            try {
+                decode(pixels);
+            } catch (...) {
+                slot->state.store(SLOT_EMPTY, std::memory_order_release);
+                throw;
+            }
+
+            slot->state.store(SLOT_READY, std::memory_order_release);
+            return pixels;
+        }
+
+        // a live process is decoding, if it hangs the caller keeps a private copy instead
+        if (std::chrono::steady_clock::now() >= deadline) {
+            return nullptr;
+        }
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+}
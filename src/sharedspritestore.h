@@ -0,0 +1,113 @@
+﻿/*
+    Copyright (c) 2022 Marcin "Nekiro" Jałocha
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+*/
+
+#ifndef SHAREDSPRITESTORE_H
+#define SHAREDSPRITESTORE_H
+
+#include "definitions.h"
+#include <functional>
+#include <mutex>
+
+namespace nekiro_proto
+{
+
+/**
+ * @struct SharedSheetKey
+ * @brief Identifies a sprite sheet across processes.
+ */
+struct SharedSheetKey {
+    int firstId = 0;   /**< First sprite ID of the sheet. */
+    std::string file;  /**< File name of the sheet, without directory. */
+};
+
+/**
+ * @class SharedSpriteStore
+ * @brief Named shared memory segment holding decoded sprite sheets for all processes on the host.
+ *
+ * The segment starts with a header and an index of sheets keyed by file name and first sprite ID,
+ * followed by one slot of decoded pixels per sheet. Each slot moves from empty to loading to ready,
+ * the process that claims a slot decodes it and everyone else waits for it and maps the same pixels.
+ * Slots are mapped on first use, and a slot left loading by a process that exited is claimed again.
+ */
+class EXPORT SharedSpriteStore
+{
+    public:
+        /**
+         * @brief Creates the segment, or opens it if another process already did.
+         *
+         * On POSIX systems the name must start with a slash, eg. "/nekiro-sprites".
+         *
+         * @param name Name of the shared memory segment.
+         * @param keys Sheets of the catalog, ordered by first sprite ID.
+         * @throws std::exception if the segment can't be created or was created for another catalog.
+         */
+        SharedSpriteStore(const std::string& name, const std::vector<SharedSheetKey>& keys);
+        ~SharedSpriteStore();
+
+        // non-copyable
+        SharedSpriteStore(const SharedSpriteStore&) = delete;
+        SharedSpriteStore& operator=(const SharedSpriteStore&) = delete;
+
+        /**
+         * @brief Gets the shared pixels of a sheet, decoding them first if no process has done so.
+         *
+         * Thread-safe. If the decode callback throws, the slot is released and the exception rethrown.
+         *
+         * @param key The sheet to acquire.
+         * @param decode Writes BYTES_IN_SPRITE_SHEET bytes of pixels into the given slot.
+         * @return const uint8_t* Sheet pixels, nullptr if the sheet isn't indexed, can't be mapped or its loader hangs.
+         */
+        const uint8_t* acquire(const SharedSheetKey& key, const std::function<void(uint8_t*)>& decode);
+
+        /**
+         * @brief Removes the named segment, processes that have it mapped keep their view.
+         *
+         * No-op on Windows, where the segment goes away with the last process using it.
+         *
+         * @param name Name of the shared memory segment.
+         */
+        static void remove(const std::string& name);
+
+    private:
+        struct Header;
+        struct Slot;
+
+        Slot* findSlot(const SharedSheetKey& key) const;
+        uint8_t* mapSlot(const Slot& slot);
+        void release();
+
+        uint8_t* base = nullptr; /**< View of the header and index. */
+        size_t size = 0;         /**< Size of the index view. */
+        std::vector<uint8_t*> views; /**< Views of sheet slots mapped so far. */
+        std::mutex viewsLock;
+#ifdef _WIN32
+        HANDLE mapping = nullptr;
+#else
+        int fd = -1;
+#endif
+};
+
+using SharedSpriteStorePtr = std::shared_ptr<SharedSpriteStore>;
+
+}
+
+#endif
@@ -21,10 +21,14 @@
 */
 
 #include "spriteappearances.h"
+#include "sharedspritestore.h"
+#include "hashing.h"
 #include "lzma.h"
 #include <nlohmann/json.hpp>
 #include <filesystem>
 #include <iostream>
+#include <thread>
+#include <atomic>
 
 using json = nlohmann::json;
 namespace fs = std::filesystem;
@@ -32,6 +36,46 @@ namespace fs = std::filesystem;
 namespace nekiro_proto
 {
 
+namespace
+{
+
+// transparent magenta of the sheets as a little-endian BGRA word, alpha 0
+constexpr uint32_t SHEET_TRANSPARENT_PIXEL = 0x00FF00FF;
+
+uint32_t readPixel(const uint8_t* pixel)
+{
+    uint32_t value;
+    std::memcpy(&value, pixel, 4);
+    return value;
+}
+
+void fillPixels(uint8_t* out, int count, const uint8_t* pixel)
+{
+    for (int i = 0; i < count; i++) {
+        std::memcpy(out + i * 4, pixel, 4);
+    }
+}
+
+// converts only pixels with alpha, leaving the rest of the destination untouched
+void convertVisiblePixels(const uint8_t* pixels, uint8_t* out, int count, PixelFormat format)
+{
+    for (int x = 0; x < count;) {
+        if (pixels[x * 4 + 3] == 0) {
+            x++;
+            continue;
+        }
+
+        int runStart = x;
+        while (x < count && pixels[x * 4 + 3] != 0) {
+            x++;
+        }
+
+        convertPixels(pixels + runStart * 4, out + runStart * 4, x - runStart, format);
+    }
+}
+
+}
+
 void SpriteAppearances::loadSpriteSheets(const std::string& dir, bool loadData /* true*/)
 {
     if (!fs::is_directory(dir)) {
@@ -52,10 +96,15 @@ void SpriteAppearances::loadSpriteSheets(const std::string& dir, bool loadData /
         throw std::exception("Unable to open catalog-content.json.");
     }
 
-    json document = json::parse(file, nullptr, false);
+    std::string content((std::istreambuf_iterator<char>(file)), (std::istreambuf_iterator<char>()));
 
     file.close();
 
+    // identifies the catalog for the bounds file, sheet file names change with every client update
+    catalogHash = fnv1a(content);
+
+    json document = json::parse(content, nullptr, false);
+
     for (const auto& obj : document) {
         const auto& type = obj["type"];
         if (type == "sprite") {
@@ -71,6 +120,21 @@ void SpriteAppearances::loadSpriteSheets(const std::string& dir, bool loadData /
             }
         }
     }
+
+    // keep sheets ordered for binary search by sprite id
+    std::sort(sheets.begin(), sheets.end(), [](const SpriteSheetPtr& a, const SpriteSheetPtr& b) {
+        return a->firstId < b->firstId;
+    });
+
+    // sheets loaded above already have their bounds computed
+    fs::path boundsPath = fs::path(dir) / fs::path("sprite-bounds.dat");
+    if (!loadData && fs::exists(boundsPath)) {
+        // the file is only a cache, a stale or damaged one is ignored
+        try {
+            loadSpriteBounds(boundsPath.string());
+        } catch (const std::exception&) {
+        }
+    }
 }
 
 void SpriteAppearances::loadSpriteSheet(const SpriteSheetPtr& sheet)
@@ -79,7 +143,34 @@ void SpriteAppearances::loadSpriteSheet(const SpriteSheetPtr& sheet)
         return;
     }
 
-    std::ifstream file(sheet->path, std::ios::binary | std::ios::in);
+    fetchSpriteSheet(*sheet);
+    finishSpriteSheet(sheet);
+}
+
+void SpriteAppearances::fetchSpriteSheet(SpriteSheet& sheet) const
+{
+    if (sharedStore) {
+        SharedSheetKey key{ sheet.firstId, fs::path(sheet.path).filename().string() };
+
+        const uint8_t* shared = sharedStore->acquire(key, [&sheet](uint8_t* pixels) {
+            decodeSpriteSheet(sheet);
+            std::memcpy(pixels, sheet.data.get(), BYTES_IN_SPRITE_SHEET);
+        });
+
+        if (shared) {
+            sheet.data.reset();
+            sheet.sharedData = shared;
+            sheet.sharedStore = sharedStore;
+            return;
+        }
+    }
+
+    decodeSpriteSheet(sheet);
+}
+
+void SpriteAppearances::decodeSpriteSheet(SpriteSheet& sheet)
+{
+    std::ifstream file(sheet.path, std::ios::binary | std::ios::in);
     if (!file.is_open()) {
         throw std::exception("Unable to open given file.");
     }
@@ -155,9 +246,19 @@ void SpriteAppearances::loadSpriteSheet(const SpriteSheetPtr& sheet)
     uint32_t data;
     std::memcpy(&data, decompressed.get() + 10, sizeof(uint32_t));
 
-    sheet->data = std::make_unique<uint8_t[]>(LZMA_UNCOMPRESSED_SIZE);
-    std::memcpy(sheet->data.get(), decompressed.get() + data, BYTES_IN_SPRITE_SHEET);
+    sheet.data = std::make_unique<uint8_t[]>(LZMA_UNCOMPRESSED_SIZE);
+    std::memcpy(sheet.data.get(), decompressed.get() + data, BYTES_IN_SPRITE_SHEET);
+}
+
+void SpriteAppearances::finishSpriteSheet(const SpriteSheetPtr& sheet)
+{
     sheet->loaded = true;
+
+    computeSpriteBounds(sheet);
+
+    if (compactResidency) {
+        sheet->compact();
+    }
 }
 
 SpriteSheetPtr SpriteAppearances::getSheetBySpriteId(int id, bool load /* = true */)
@@ -166,17 +267,11 @@ SpriteSheetPtr SpriteAppearances::getSheetBySpriteId(int id, bool load /* = true
         return nullptr;
     }
 
-    // find sheet
-    auto sheetIt = std::find_if(sheets.begin(), sheets.end(), [=](SpriteSheetPtr sheet) {
-        return id >= sheet->firstId && id <= sheet->lastId;
-    });
-
-    if (sheetIt == sheets.end()) {
+    const SpriteSheetPtr& sheet = findSheet(id);
+    if (!sheet) {
         return nullptr;
     }
 
-    const SpriteSheetPtr& sheet = *sheetIt;
-
     if (load && !sheet->loaded) {
         loadSpriteSheet(sheet);
     }
@@ -184,6 +279,168 @@ SpriteSheetPtr SpriteAppearances::getSheetBySpriteId(int id, bool load /* = true
     return sheet;
 }
 
+SpriteSize SpriteAppearances::getSpriteSize(int id) const
+{
+    const SpriteSheetPtr& sheet = findSheet(id);
+    if (id == 0 || !sheet) {
+        return SpriteSize(0, 0);
+    }
+
+    return sheet->getSpriteSize();
+}
+
+std::vector<SpriteSheetPtr> SpriteAppearances::getSheetsBySpriteIds(const std::vector<uint32_t>& ids) const
+{
+    std::vector<SpriteSheetPtr> result;
+    for (uint32_t id : ids) {
+        if (id == 0) {
+            continue;
+        }
+
+        const SpriteSheetPtr& sheet = findSheet(static_cast<int>(id));
+        if (sheet) {
+            result.push_back(sheet);
+        }
+    }
+
+    std::sort(result.begin(), result.end(), [](const SpriteSheetPtr& a, const SpriteSheetPtr& b) {
+        return a->firstId < b->firstId;
+    });
+    result.erase(std::unique(result.begin(), result.end()), result.end());
+
+    return result;
+}
+
+const SpriteSheetPtr& SpriteAppearances::findSheet(int id) const
+{
+    static const SpriteSheetPtr none;
+
+    // first sheet starting after id, the one before it is the only candidate
+    auto sheetIt = std::upper_bound(sheets.begin(), sheets.end(), id, [](int id, const SpriteSheetPtr& sheet) {
+        return id < sheet->firstId;
+    });
+
+    if (sheetIt == sheets.begin()) {
+        return none;
+    }
+
+    const SpriteSheetPtr& sheet = *(sheetIt - 1);
+    if (id > sheet->lastId) {
+        return none;
+    }
+
+    return sheet;
+}
+
+void SpriteAppearances::getSprites(const std::vector<int>& ids, SpriteBatch& batch, PixelFormat format /* = PixelFormat::BGRA */, bool parallel /* = false */)
+{
+    batch.entries.clear();
+    batch.entries.resize(ids.size());
+
+    // resolve sheets and lay out the arena in request order
+    std::vector<std::pair<const SpriteSheetPtr*, size_t>> order;
+    order.reserve(ids.size());
+
+    size_t arenaSize = 0;
+    for (size_t i = 0; i < ids.size(); i++) {
+        SpriteBatchEntry& entry = batch.entries[i];
+        entry.id = ids[i];
+
+        if (ids[i] == 0) {
+            continue;
+        }
+
+        const SpriteSheetPtr& sheet = findSheet(ids[i]);
+        if (!sheet) {
+            continue;
+        }
+
+        entry.size = sheet->getSpriteSize();
+        entry.offset = arenaSize;
+        arenaSize += entry.size.area() * 4;
+
+        order.emplace_back(&sheet, i);
+    }
+
+    batch.pixels.resize(arenaSize);
+
+    // group by sheet, sheets are ordered by first id so this also sorts by id
+    std::sort(order.begin(), order.end(), [](const std::pair<const SpriteSheetPtr*, size_t>& a, const std::pair<const SpriteSheetPtr*, size_t>& b) {
+        if (a.first != b.first) {
+            return (*a.first)->firstId < (*b.first)->firstId;
+        }
+        return a.second < b.second;
+    });
+
+    std::vector<SpriteSheetPtr> pending;
+    for (size_t i = 0; i < order.size(); i++) {
+        const SpriteSheetPtr& sheet = *order[i].first;
+        if (!sheet->loaded && (i == 0 || order[i - 1].first != order[i].first)) {
+            pending.push_back(sheet);
+        }
+    }
+
+    loadPendingSheets(pending, parallel);
+
+    for (const auto& [sheetPtr, index] : order) {
+        const SpriteSheetPtr& sheet = *sheetPtr;
+        SpriteBatchEntry& entry = batch.entries[index];
+        sheet->copySprite(entry.id - sheet->firstId, &batch.pixels[entry.offset], entry.size.width * 4, format);
+        entry.found = true;
+    }
+}
+
+void SpriteAppearances::loadPendingSheets(const std::vector<SpriteSheetPtr>& pending, bool parallel)
+{
+    if (!parallel || pending.size() < 2) {
+        for (const SpriteSheetPtr& sheet : pending) {
+            loadSpriteSheet(sheet);
+        }
+        return;
+    }
+
+    // fetching is independent per sheet, everything touching shared state runs afterwards
+    size_t workers = std::min<size_t>(pending.size(), std::max<unsigned>(1, std::thread::hardware_concurrency()));
+    std::atomic<size_t> next{ 0 };
+    std::vector<std::exception_ptr> errors(workers);
+    std::vector<std::thread> threads;
+    threads.reserve(workers);
+
+    try {
+        for (size_t worker = 0; worker < workers; worker++) {
+            threads.emplace_back([&, worker]() {
+                try {
+                    for (size_t i = next++; i < pending.size(); i = next++) {
+                        fetchSpriteSheet(*pending[i]);
+                    }
+                } catch (...) {
+                    errors[worker] = std::current_exception();
+                }
+            });
+        }
+    } catch (...) {
+        // destroying joinable threads would terminate the process
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+        throw;
+    }
+
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    for (const std::exception_ptr& error : errors) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+    for (const SpriteSheetPtr& sheet : pending) {
+        finishSpriteSheet(sheet);
+    }
+}
+
 void SpriteAppearances::exportSpriteImage(int id, const std::string& path)
 {
     BmpImgPtr image = getSpriteImage(id);
@@ -219,24 +476,432 @@ SpritePtr SpriteAppearances::getSprite(int spriteId)
     const SpriteSize& size = sheet->getSpriteSize();
 
     SpritePtr sprite = SpritePtr(new Sprite());
-
+    sprite->size = size;
     sprite->pixels.resize(size.area() * 4, 0);
 
-    int spriteOffset = spriteId - sheet->firstId;
-    int allColumns = size.width == 32 ? 12 : 6; // 64 pixel width == 6 columns each 64x or 32 pixels, 12 columns
-    int spriteRow = static_cast<int>(std::floor(static_cast<float>(spriteOffset) / static_cast<float>(allColumns)));
-    int spriteColumn = spriteOffset % allColumns;
+    sheet->copySprite(spriteId - sheet->firstId, sprite->pixels.data(), size.width * 4, PixelFormat::BGRA);
+
+    // compact sheets decode cheaply, keeping dense copies around would defeat the purpose
+    if (!sheet->compacted) {
+        // cache it for faster later access
+        sprites[spriteId] = sprite;
+    }
+
+    return sprite;
+}
+
+bool SpriteAppearances::copySpriteTo(int id, uint8_t* dst, size_t dstSize, size_t stride /* = 0 */, PixelFormat format /* = PixelFormat::BGRA */)
+{
+    return writeSprite(id, dst, dstSize, stride, format, false);
+}
 
-    int spriteWidthBytes = size.width * 4;
+size_t SpriteAppearances::copySpritesTo(const std::vector<SpriteCopyRequest>& requests, PixelFormat format /* = PixelFormat::BGRA */)
+{
+    size_t copied = 0;
+    for (const SpriteCopyRequest& request : requests) {
+        if (copySpriteTo(request.id, request.dst, request.dstSize, request.stride, format)) {
+            copied++;
+        }
+    }
+
+    return copied;
+}
 
-    for (int height = size.height * spriteRow, offset = 0; height < size.height + (spriteRow * size.height); height++, offset++) {
-        std::memcpy(&sprite->pixels[offset * spriteWidthBytes], &sheet->data[(height * SPRITE_SHEET_WIDTH_BYTES) + (spriteColumn * spriteWidthBytes)], spriteWidthBytes);
+bool SpriteAppearances::blitSpriteTo(int id, uint8_t* dst, size_t dstSize, size_t stride /* = 0 */, PixelFormat format /* = PixelFormat::BGRA */)
+{
+    return writeSprite(id, dst, dstSize, stride, format, true);
+}
+
+bool SpriteAppearances::writeSprite(int id, uint8_t* dst, size_t dstSize, size_t stride, PixelFormat format, bool skipTransparent)
+{
+    SpriteSheetPtr sheet = getSheetBySpriteId(id);
+    if (!sheet || !sheet->loaded) {
+        return false;
     }
 
-    // cache it for faster later access
-    sprites[spriteId] = sprite;
+    const SpriteSize size = sheet->getSpriteSize();
+    const size_t rowBytes = static_cast<size_t>(size.width) * 4;
+    if (stride == 0) {
+        stride = rowBytes;
+    }
 
-    return sprite;
+    // last row only needs its own pixels, not a full stride
+    if (stride < rowBytes || dstSize < (size.height - 1) * stride + rowBytes) {
+        return false;
+    }
+
+    sheet->copySprite(id - sheet->firstId, dst, stride, format, skipTransparent);
+    return true;
 }
 
-}
\ No newline at end of file
+void SpriteAppearances::enableSharedMemory(const std::string& name)
+{
+    std::vector<SharedSheetKey> keys;
+    keys.reserve(sheets.size());
+    for (const SpriteSheetPtr& sheet : sheets) {
+        keys.push_back(SharedSheetKey{ sheet->firstId, fs::path(sheet->path).filename().string() });
+    }
+
+    sharedStore = std::make_shared<SharedSpriteStore>(name, keys);
+}
+
+void SpriteAppearances::setCompactResidency(bool enabled)
+{
+    compactResidency = enabled;
+    if (!enabled) {
+        return;
+    }
+
+    for (const SpriteSheetPtr& sheet : sheets) {
+        sheet->compact();
+    }
+
+    sprites.clear();
+}
+
+double SpriteAppearances::getCompressionRatio() const
+{
+    size_t denseBytes = 0;
+    size_t residentBytes = 0;
+    for (const SpriteSheetPtr& sheet : sheets) {
+        // shared sheets hold no private memory, compact residency doesn't apply to them
+        if (sheet->loaded && !sheet->sharedData) {
+            denseBytes += BYTES_IN_SPRITE_SHEET;
+            residentBytes += sheet->getResidentBytes();
+        }
+    }
+
+    if (residentBytes == 0) {
+        return 1.0;
+    }
+
+    return static_cast<double>(denseBytes) / static_cast<double>(residentBytes);
+}
+
+void SpriteAppearances::computeSpriteBounds(const SpriteSheetPtr& sheet)
+{
+    if (!sheet->loaded || sheet->compacted) {
+        return;
+    }
+
+    if (static_cast<int>(spriteBounds.size()) <= sheet->lastId) {
+        spriteBounds.resize(sheet->lastId + 1);
+    }
+
+    const SpriteSize size = sheet->getSpriteSize();
+    int count = sheet->getSpriteSlots();
+
+    for (int index = 0; index < count; index++) {
+        const uint8_t* sprite = sheet->getSpriteData(index);
+
+        int left = size.width;
+        int right = -1;
+        int top = -1;
+        int bottom = -1;
+        bool opaque = true;
+
+        for (int row = 0; row < size.height; row++) {
+            AlphaScan scan = scanAlpha(sprite + row * SPRITE_SHEET_WIDTH_BYTES, size.width);
+            opaque = opaque && scan.opaque;
+
+            if (scan.first < 0) {
+                continue;
+            }
+
+            if (top < 0) {
+                top = row;
+            }
+
+            bottom = row;
+            left = std::min<int>(left, scan.first);
+            right = std::max<int>(right, scan.last);
+        }
+
+        SpriteBounds& bounds = spriteBounds[sheet->firstId + index];
+        bounds = SpriteBounds();
+        bounds.flags = SPRITE_BOUNDS_KNOWN;
+
+        if (top < 0) {
+            bounds.flags |= SPRITE_BOUNDS_EMPTY;
+            continue;
+        }
+
+        if (opaque) {
+            bounds.flags |= SPRITE_BOUNDS_OPAQUE;
+        }
+
+        bounds.x = static_cast<uint8_t>(left);
+        bounds.y = static_cast<uint8_t>(top);
+        bounds.width = static_cast<uint8_t>(right - left + 1);
+        bounds.height = static_cast<uint8_t>(bottom - top + 1);
+    }
+}
+
+void SpriteAppearances::saveSpriteBounds(const std::string& path) const
+{
+    std::ofstream file(path, std::ios::binary | std::ios::out);
+    if (!file.is_open()) {
+        throw std::exception("Unable to open given file.");
+    }
+
+    /*
+        Bounds file format:
+        [0x00, 0x04):       Magic "SPBD".
+        [0x04, 0x08):       Sprites count of the catalog.
+        [0x08, 0x10):       Hash of catalog-content.json.
+        [0x10, 0x14):       Number of entries, indexed by sprite id.
+        [0x14, ...):        Entries, 5 bytes each (x, y, width, height, flags).
+    */
+
+    uint32_t sprites = static_cast<uint32_t>(spritesCount);
+    uint32_t count = static_cast<uint32_t>(spriteBounds.size());
+    file.write("SPBD", 4);
+    file.write(reinterpret_cast<const char*>(&sprites), sizeof(sprites));
+    file.write(reinterpret_cast<const char*>(&catalogHash), sizeof(catalogHash));
+    file.write(reinterpret_cast<const char*>(&count), sizeof(count));
+    for (const SpriteBounds& bounds : spriteBounds) {
+        const uint8_t entry[5] = { bounds.x, bounds.y, bounds.width, bounds.height, bounds.flags };
+        file.write(reinterpret_cast<const char*>(entry), sizeof(entry));
+    }
+
+    if (!file) {
+        throw std::exception("Unable to write sprite bounds.");
+    }
+}
+
+bool SpriteAppearances::loadSpriteBounds(const std::string& path)
+{
+    std::ifstream file(path, std::ios::binary | std::ios::in);
+    if (!file.is_open()) {
+        throw std::exception("Unable to open given file.");
+    }
+
+    char magic[4] = {};
+    uint32_t sprites = 0;
+    uint64_t hash = 0;
+    uint32_t count = 0;
+    file.read(magic, sizeof(magic));
+    file.read(reinterpret_cast<char*>(&sprites), sizeof(sprites));
+    file.read(reinterpret_cast<char*>(&hash), sizeof(hash));
+    file.read(reinterpret_cast<char*>(&count), sizeof(count));
+    if (!file || std::memcmp(magic, "SPBD", 4) != 0) {
+        throw std::exception("Invalid sprite bounds file.");
+    }
+
+    // saved for another catalog, its bounds don't describe these sprites
+    if (sprites != static_cast<uint32_t>(spritesCount) || hash != catalogHash || count > sprites + 1) {
+        return false;
+    }
+
+    std::vector<uint8_t> entries(static_cast<size_t>(count) * 5);
+    file.read(reinterpret_cast<char*>(entries.data()), entries.size());
+    if (!file) {
+        throw std::exception("Invalid sprite bounds file.");
+    }
+
+    spriteBounds.assign(count, SpriteBounds());
+    for (uint32_t i = 0; i < count; i++) {
+        const uint8_t* entry = &entries[i * 5];
+        SpriteBounds& bounds = spriteBounds[i];
+        bounds.x = entry[0];
+        bounds.y = entry[1];
+        bounds.width = entry[2];
+        bounds.height = entry[3];
+        bounds.flags = entry[4];
+    }
+
+    return true;
+}
+
+bool SpriteSheet::exportSheetImage(const std::string& file, bool fixMagenta /* = false */)
+{
+    if (!compacted) {
+        BmpImg image(384, 384, getPixelData());
+        return image.write(file, fixMagenta) == BMP_OK;
+    }
+
+    // decode every sprite back into its place, slots past the last sprite stay transparent
+    std::vector<uint8_t> pixels(BYTES_IN_SPRITE_SHEET);
+    fillPixels(pixels.data(), (BYTES_IN_SPRITE_SHEET) / 4, reinterpret_cast<const uint8_t*>(&transparentPixel));
+    for (int index = 0; index < static_cast<int>(runOffsets.size()); index++) {
+        copySprite(index, &pixels[getSpriteDataOffset(index)], SPRITE_SHEET_WIDTH_BYTES, PixelFormat::BGRA);
+    }
+
+    BmpImg image(384, 384, pixels.data());
+    return image.write(file, fixMagenta) == BMP_OK;
+}
+
+void SpriteSheet::compact()
+{
+    if (!loaded || compacted || sharedData) {
+        return;
+    }
+
+    const SpriteSize size = getSpriteSize();
+    int count = getSpriteSlots();
+
+    runs.clear();
+    runOffsets.clear();
+    runOffsets.reserve(count);
+
+    // sheets fill transparent pixels with one value, usually magenta, only that value is skipped
+    transparentPixel = SHEET_TRANSPARENT_PIXEL;
+    const uint8_t* sheetPixels = getPixelData();
+    for (size_t offset = 3; offset < (BYTES_IN_SPRITE_SHEET); offset += 4) {
+        if (sheetPixels[offset] == 0) {
+            transparentPixel = readPixel(sheetPixels + offset - 3);
+            break;
+        }
+    }
+
+    /*
+        Sprite encoding, rows top to bottom:
+        [0x00]:             Number of runs in the row.
+        Per run:
+        [0x00]:             Transparent pixels skipped since the end of the previous run.
+        [0x01]:             Number of pixels in the run.
+        [0x02, len * 4):    Pixels of the run.
+    */
+
+    for (int index = 0; index < count; index++) {
+        runOffsets.push_back(static_cast<uint32_t>(runs.size()));
+
+        const uint8_t* sprite = getSpriteData(index);
+        for (int row = 0; row < size.height; row++) {
+            const uint8_t* pixels = sprite + row * SPRITE_SHEET_WIDTH_BYTES;
+
+            size_t runCountPos = runs.size();
+            runs.push_back(0);
+
+            int x = 0;
+            while (x < size.width) {
+                int skipStart = x;
+                while (x < size.width && readPixel(pixels + x * 4) == transparentPixel) {
+                    x++;
+                }
+
+                if (x == size.width) {
+                    break;
+                }
+
+                // other pixels are kept as they are, so both residency modes decode the same bytes
+                int runStart = x;
+                while (x < size.width && readPixel(pixels + x * 4) != transparentPixel) {
+                    x++;
+                }
+
+                runs.push_back(static_cast<uint8_t>(runStart - skipStart));
+                runs.push_back(static_cast<uint8_t>(x - runStart));
+                runs.insert(runs.end(), pixels + runStart * 4, pixels + x * 4);
+                runs[runCountPos]++;
+            }
+        }
+    }
+
+    runs.shrink_to_fit();
+    data.reset();
+    compacted = true;
+}
+
+void SpriteSheet::copySprite(int index, uint8_t* dst, size_t stride, PixelFormat format, bool skipTransparent /* = false */) const
+{
+    const SpriteSize size = getSpriteSize();
+
+    if (!compacted) {
+        const uint8_t* sprite = getSpriteData(index);
+        for (int row = 0; row < size.height; row++) {
+            const uint8_t* pixels = sprite + row * SPRITE_SHEET_WIDTH_BYTES;
+            uint8_t* out = dst + row * stride;
+
+            if (!skipTransparent) {
+                convertPixels(pixels, out, size.width, format);
+            } else {
+                convertVisiblePixels(pixels, out, size.width, format);
+            }
+        }
+        return;
+    }
+
+    // skipped pixels decode as the sheet's transparent pixel, converted like any other pixel
+    uint8_t fill[4];
+    std::memcpy(fill, &transparentPixel, 4);
+    convertPixels(fill, fill, 1, format);
+
+    // slots past the end of the sheet have no pixels
+    if (index < 0 || index >= static_cast<int>(runOffsets.size())) {
+        if (!skipTransparent) {
+            for (int row = 0; row < size.height; row++) {
+                fillPixels(dst + row * stride, size.width, fill);
+            }
+        }
+        return;
+    }
+
+    const uint8_t* src = runs.data() + runOffsets[index];
+    for (int row = 0; row < size.height; row++) {
+        uint8_t* out = dst + row * stride;
+        int x = 0;
+
+        uint8_t runCount = *src++;
+        for (uint8_t run = 0; run < runCount; run++) {
+            int skip = *src++;
+            int length = *src++;
+
+            if (!skipTransparent) {
+                fillPixels(out + x * 4, skip, fill);
+                convertPixels(src, out + (x + skip) * 4, length, format);
+            } else {
+                convertVisiblePixels(src, out + (x + skip) * 4, length, format);
+            }
+
+            x += skip + length;
+            src += length * 4;
+        }
+
+        if (!skipTransparent) {
+            fillPixels(out + x * 4, size.width - x, fill);
+        }
+    }
+}
+
+size_t SpriteSheet::getResidentBytes() const
+{
+    if (!loaded || sharedData) {
+        return 0;
+    }
+
+    if (compacted) {
+        return runs.size() + runOffsets.size() * sizeof(uint32_t);
+    }
+
+    return BYTES_IN_SPRITE_SHEET;
+}
+
+int SpriteSheet::getSpriteSlots() const
+{
+    const SpriteSize size = getSpriteSize();
+    return std::min<int>(lastId - firstId + 1, (384 / size.width) * (384 / size.height));
+}
+
+const uint8_t* SpriteSheet::getSpriteData(int index) const
+{
+    const uint8_t* pixels = getPixelData();
+    if (compacted || !pixels) {
+        return nullptr;
+    }
+
+    return pixels + getSpriteDataOffset(index);
+}
+
+size_t SpriteSheet::getSpriteDataOffset(int index) const
+{
+    const SpriteSize size = getSpriteSize();
+
+    int allColumns = size.width == 32 ? 12 : 6; // 64 pixel width == 6 columns each 64x or 32 pixels, 12 columns
+    int spriteRow = index / allColumns;
+    int spriteColumn = index % allColumns;
+
+    return (size.height * spriteRow * SPRITE_SHEET_WIDTH_BYTES) + (spriteColumn * size.width * 4);
+}
+
+}
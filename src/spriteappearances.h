@@ -25,6 +25,7 @@
 
 #include "definitions.h"
 #include "libbmp.h"
+#include "pixelformat.h"
 
 namespace nekiro_proto
 {
@@ -75,12 +76,14 @@ struct EXPORT Sprite {
         SpriteSize size;
 };
 
+class SharedSpriteStore;
+
 class EXPORT SpriteSheet
 {
     public:
         SpriteSheet(int firstId, int lastId, SpriteLayout spriteLayout, const std::string& path) : firstId(firstId), lastId(lastId), spriteLayout(spriteLayout), path(path) {}
 
-        SpriteSize getSpriteSize() {
+        SpriteSize getSpriteSize() const {
             SpriteSize size(SPRITE_SIZE, SPRITE_SIZE);
 
             switch (spriteLayout) {
@@ -94,17 +97,132 @@ class EXPORT SpriteSheet
             return size;
         }
 
-        bool exportSheetImage(const std::string& file, bool fixMagenta = false) {
-            BmpImg image(384, 384, data.get());
-            return image.write(file, fixMagenta) == BMP_OK;
-        };
+        bool exportSheetImage(const std::string& file, bool fixMagenta = false);
+
+        /**
+         * @brief Gets dense pixel data of the whole sheet, owned or shared.
+         *
+         * @return const uint8_t* Sheet pixels, nullptr if not loaded or compacted.
+         */
+        const uint8_t* getPixelData() const {
+            return data ? data.get() : sharedData;
+        }
+
+        /**
+         * @brief Re-encodes loaded pixel data into per-row transparent runs and frees the dense data.
+         *
+         * Every sprite row is stored as a run count followed by (skip, length, pixels) runs,
+         * pixels equal to the sheet's transparent fill (usually magenta with alpha 0) are not stored
+         * and decode back to the same bytes, so both residency modes return identical pixels.
+         * Sheets living in shared memory are left as they are.
+         */
+        void compact();
+
+        /**
+         * @brief Writes a sprite of this sheet into caller memory.
+         *
+         * @param index Position of the sprite in the sheet (id - firstId).
+         * @param dst First byte of the destination, top left pixel.
+         * @param stride Bytes between destination rows.
+         * @param format Pixel format written to the destination.
+         * @param skipTransparent If true, transparent pixels leave the destination untouched.
+         */
+        void copySprite(int index, uint8_t* dst, size_t stride, PixelFormat format, bool skipTransparent = false) const;
+
+        /**
+         * @brief Gets the number of private bytes holding this sheet's pixels.
+         *
+         * @return size_t Dense or compact size, 0 if not loaded or kept in shared memory.
+         */
+        size_t getResidentBytes() const;
+
+        /**
+         * @brief Gets the number of sprite slots in this sheet.
+         *
+         * @return int Sprites between firstId and lastId, capped by the sheet layout.
+         */
+        int getSpriteSlots() const;
+
+        /**
+         * @brief Gets dense pixel data of a sprite.
+         *
+         * @param index Position of the sprite in the sheet (id - firstId).
+         * @return const uint8_t* Top left pixel, rows are SPRITE_SHEET_WIDTH_BYTES apart, nullptr if compacted.
+         */
+        const uint8_t* getSpriteData(int index) const;
 
         int firstId = 0;
         int lastId = 0;
         SpriteLayout spriteLayout = SpriteLayout::ONE_BY_ONE;
         std::unique_ptr<uint8_t[]> data;
+        const uint8_t* sharedData = nullptr;
+        std::shared_ptr<SharedSpriteStore> sharedStore; /**< Keeps sharedData mapped for as long as the sheet lives. */
+        std::vector<uint8_t> runs;
+        std::vector<uint32_t> runOffsets;
+        uint32_t transparentPixel = 0; /**< Skipped pixel value of a compacted sheet, little-endian BGRA. */
         std::string path;
         bool loaded = false;
+        bool compacted = false;
+
+    private:
+        size_t getSpriteDataOffset(int index) const;
+};
+
+/**
+ * @struct SpriteCopyRequest
+ * @brief Destination of a single sprite in a batched copy.
+ */
+struct SpriteCopyRequest {
+    int id = 0;             /**< The ID of the sprite. */
+    uint8_t* dst = nullptr; /**< First byte of the destination, top left pixel. */
+    size_t dstSize = 0;     /**< Bytes available at dst. */
+    size_t stride = 0;      /**< Bytes between destination rows, 0 for tightly packed rows. */
+};
+
+enum SpriteBoundsFlags : uint8_t {
+    SPRITE_BOUNDS_KNOWN = 1 << 0,   /**< Bounds were computed or loaded for this sprite. */
+    SPRITE_BOUNDS_OPAQUE = 1 << 1,  /**< Every pixel of the sprite has full alpha. */
+    SPRITE_BOUNDS_EMPTY = 1 << 2,   /**< Every pixel of the sprite is transparent. */
+};
+
+/**
+ * @struct SpriteBounds
+ * @brief Tight non-transparent rectangle of a sprite, relative to its top left pixel.
+ */
+struct SpriteBounds {
+    uint8_t x = 0;
+    uint8_t y = 0;
+    uint8_t width = 0;
+    uint8_t height = 0;
+    uint8_t flags = 0; /**< Combination of SpriteBoundsFlags. */
+
+    bool isKnown() const { return (flags & SPRITE_BOUNDS_KNOWN) != 0; }
+    bool isOpaque() const { return (flags & SPRITE_BOUNDS_OPAQUE) != 0; }
+    bool isEmpty() const { return (flags & SPRITE_BOUNDS_EMPTY) != 0; }
+};
+
+/**
+ * @struct SpriteBatchEntry
+ * @brief Location of a single sprite inside a SpriteBatch arena.
+ */
+struct SpriteBatchEntry {
+    int id = 0;            /**< The ID of the sprite. */
+    size_t offset = 0;     /**< Byte offset of the top left pixel in the arena. */
+    SpriteSize size;       /**< Dimensions of the sprite, rows are tightly packed. */
+    bool found = false;    /**< False if the sprite ID is unknown. */
+};
+
+/**
+ * @struct SpriteBatch
+ * @brief Pixels of many sprites in one contiguous arena, reusable between calls.
+ */
+struct SpriteBatch {
+    const uint8_t* getPixels(size_t index) const {
+        return pixels.data() + entries[index].offset;
+    }
+
+    std::vector<uint8_t> pixels;            /**< Arena holding all found sprites. */
+    std::vector<SpriteBatchEntry> entries;  /**< One entry per requested ID, in request order. */
 };
 
 using SpriteSheetPtr = std::shared_ptr<SpriteSheet>;
@@ -138,6 +256,22 @@ class EXPORT SpriteAppearances
          */
         SpriteSheetPtr getSheetBySpriteId(int id, bool load = true);
 
+        /**
+         * @brief Gets the size of the specified sprite without loading its sheet.
+         *
+         * @param id The ID of the sprite.
+         * @return SpriteSize Size of the sprite, 0x0 if the sprite ID is unknown.
+         */
+        SpriteSize getSpriteSize(int id) const;
+
+        /**
+         * @brief Retrieves the sprite sheets containing any of the specified sprite IDs, without loading them.
+         * 
+         * @param ids The IDs of the sprites, eg. AppearancesDiff::sprites.
+         * @return std::vector<SpriteSheetPtr> Distinct sheets ordered by first sprite ID.
+         */
+        std::vector<SpriteSheetPtr> getSheetsBySpriteIds(const std::vector<uint32_t>& ids) const;
+
         /**
          * @brief Exports the image of the specified sprite to a file.
          * 
@@ -154,6 +288,31 @@ class EXPORT SpriteAppearances
          */
         SpritePtr getSprite(int id);
 
+        /**
+         * @brief Copies the pixels of the specified sprite into caller memory.
+         *
+         * Reads straight from the sprite sheet, bypassing the sprite cache, so nothing is allocated
+         * once the sheet is loaded. Destination must hold size.height rows of size.width pixels,
+         * size can be obtained from getSpriteSize(id).
+         *
+         * @param id The ID of the sprite.
+         * @param dst First byte of the destination, top left pixel.
+         * @param dstSize Bytes available at dst.
+         * @param stride Bytes between destination rows, 0 for tightly packed rows.
+         * @param format Pixel format written to the destination.
+         * @return bool False if the sprite ID is unknown or the destination is too small.
+         */
+        bool copySpriteTo(int id, uint8_t* dst, size_t dstSize, size_t stride = 0, PixelFormat format = PixelFormat::BGRA);
+
+        /**
+         * @brief Copies the pixels of multiple sprites into caller memory.
+         *
+         * @param requests Sprites and their destinations.
+         * @param format Pixel format written to every destination.
+         * @return size_t Number of sprites copied, unknown sprite IDs and too small destinations are skipped.
+         */
+        size_t copySpritesTo(const std::vector<SpriteCopyRequest>& requests, PixelFormat format = PixelFormat::BGRA);
+
         /**
          * @brief Gets the total number of sprites.
          * 
@@ -163,6 +322,98 @@ class EXPORT SpriteAppearances
             return spritesCount;
         }
 
+        /**
+         * @brief Retrieves many sprites at once into a single arena.
+         *
+         * Requests are grouped by sheet, so every needed sheet is resolved and loaded once,
+         * optionally decoding the sheets on multiple threads.
+         *
+         * @param ids The IDs of the sprites, duplicates are allowed.
+         * @param batch Receives the arena and offset table, its buffers are reused.
+         * @param format Pixel format written to the arena.
+         * @param parallel If true, sheets that are not loaded yet are decoded in parallel.
+         */
+        void getSprites(const std::vector<int>& ids, SpriteBatch& batch, PixelFormat format = PixelFormat::BGRA, bool parallel = false);
+
+        /**
+         * @brief Writes the specified sprite into caller memory, leaving transparent pixels untouched.
+         *
+         * @param id The ID of the sprite.
+         * @param dst First byte of the destination, top left pixel.
+         * @param dstSize Bytes available at dst.
+         * @param stride Bytes between destination rows, 0 for tightly packed rows.
+         * @param format Pixel format written to the destination.
+         * @return bool False if the sprite ID is unknown or the destination is too small.
+         */
+        bool blitSpriteTo(int id, uint8_t* dst, size_t dstSize, size_t stride = 0, PixelFormat format = PixelFormat::BGRA);
+
+        /**
+         * @brief Gets the trimmed bounds and opacity of the specified sprite.
+         *
+         * Bounds are computed when a sheet is loaded, or read with loadSpriteBounds.
+         *
+         * @param id The ID of the sprite.
+         * @return SpriteBounds Bounds of the sprite, without SPRITE_BOUNDS_KNOWN flag if not available.
+         */
+        SpriteBounds getSpriteBounds(int id) const {
+            if (id < 0 || id >= static_cast<int>(spriteBounds.size())) {
+                return SpriteBounds();
+            }
+
+            return spriteBounds[id];
+        }
+
+        /**
+         * @brief Saves the bounds table to a file.
+         *
+         * loadSpriteSheets picks up sprite-bounds.dat from the catalog directory automatically.
+         *
+         * @param path The file path to save the table.
+         */
+        void saveSpriteBounds(const std::string& path) const;
+
+        /**
+         * @brief Loads the bounds table from a file, replacing the current one.
+         *
+         * The file is only accepted if it was saved for the currently loaded catalog.
+         *
+         * @param path The file path to load the table from.
+         * @return bool False if the file belongs to another catalog, the current table is kept.
+         * @throws std::exception if the file can't be opened or is damaged.
+         */
+        bool loadSpriteBounds(const std::string& path);
+
+        /**
+         * @brief Enables or disables compact residency.
+         *
+         * In compact mode every loaded sheet is re-encoded into transparent runs and sprites
+         * are decoded on access instead of being cached. Enabling it compacts already loaded sheets,
+         * disabling it only affects sheets loaded afterwards.
+         *
+         * @param enabled If true, sheets are kept in compact form.
+         */
+        void setCompactResidency(bool enabled);
+
+        /**
+         * @brief Keeps decoded sheets in a named shared memory segment used by every process on the host.
+         *
+         * Call after loadSpriteSheets(dir, false). The first process to need a sheet decodes it into
+         * the segment, other processes map the same pixels instead of decoding their own copy.
+         * Sheets already loaded stay private, shared sheets are never compacted. Each shared sheet
+         * keeps its segment mapped, so calling this again only affects sheets loaded afterwards.
+         *
+         * @param name Name of the segment, on POSIX systems it must start with a slash.
+         * @throws std::exception if the segment can't be mapped or belongs to another catalog.
+         */
+        void enableSharedMemory(const std::string& name);
+
+        /**
+         * @brief Gets the ratio of dense to resident bytes over all loaded sheets outside shared memory.
+         *
+         * @return double Compression ratio, 1.0 if nothing is compacted.
+         */
+        double getCompressionRatio() const;
+
     private:
         /**
          * @brief Retrieves the image of the specified sprite.
@@ -172,9 +423,69 @@ class EXPORT SpriteAppearances
          */
         BmpImgPtr getSpriteImage(int id);
 
+        /**
+         * @brief Writes the specified sprite from its loaded sheet.
+         *
+         * @param id The ID of the sprite.
+         * @param dst First byte of the destination, top left pixel.
+         * @param stride Bytes between destination rows, 0 for tightly packed rows.
+         * @param format Pixel format written to the destination.
+         * @param skipTransparent If true, transparent pixels leave the destination untouched.
+         * @return bool False if the sprite ID is unknown.
+         */
+        bool writeSprite(int id, uint8_t* dst, size_t dstSize, size_t stride, PixelFormat format, bool skipTransparent);
+
+        /**
+         * @brief Finds the sheet containing the specified sprite ID without loading it.
+         *
+         * @param id The ID of the sprite.
+         * @return const SpriteSheetPtr& The sheet, or an empty pointer if not found.
+         */
+        const SpriteSheetPtr& findSheet(int id) const;
+
+        /**
+         * @brief Decompresses a sheet's pixel data, touches nothing but the sheet itself.
+         *
+         * @param sheet The sprite sheet to decode.
+         */
+        static void decodeSpriteSheet(SpriteSheet& sheet);
+
+        /**
+         * @brief Decodes a sheet, or maps it from shared memory when enabled. Thread-safe per sheet.
+         *
+         * @param sheet The sprite sheet to fetch.
+         */
+        void fetchSpriteSheet(SpriteSheet& sheet) const;
+
+        /**
+         * @brief Marks a decoded sheet as loaded and runs the per-sheet passes.
+         *
+         * @param sheet The decoded sprite sheet.
+         */
+        void finishSpriteSheet(const SpriteSheetPtr& sheet);
+
+        /**
+         * @brief Loads the given sheets, decoding them on worker threads if requested.
+         *
+         * @param pending Sheets that are not loaded yet.
+         * @param parallel If true, decoding is spread over the available cores.
+         */
+        void loadPendingSheets(const std::vector<SpriteSheetPtr>& pending, bool parallel);
+
+        /**
+         * @brief Computes bounds of every sprite in a sheet with dense data.
+         *
+         * @param sheet The loaded sprite sheet.
+         */
+        void computeSpriteBounds(const SpriteSheetPtr& sheet);
+
         int spritesCount = 0;
+        uint64_t catalogHash = 0;
         std::vector<SpriteSheetPtr> sheets;
         std::map<int, SpritePtr> sprites;
+        std::vector<SpriteBounds> spriteBounds;
+        bool compactResidency = false;
+        std::shared_ptr<SharedSpriteStore> sharedStore;
 };
 
 }